@@ -1394,6 +1394,16 @@ DLMALLOC_EXPORT struct mallinfo mspace_mallinfo(mspace msp);
 */
 DLMALLOC_EXPORT size_t mspace_usable_size(const void* mem);
 
+#if FOOTERS
+/*
+  mspace_of(void* p) returns the mspace that allocated chunk p, as found
+  from its footer, or 0 if that is not an mspace or p is not in use
+  (e.g. p is a wild pointer, was already freed, or was allocated by
+  something else). (Added for libmallochooks' terminal-mspace.c.)
+*/
+DLMALLOC_EXPORT mspace mspace_of(const void* mem);
+#endif /* FOOTERS */
+
 /*
   mspace_malloc_stats behaves as malloc_stats, but reports
   properties of the given space.
@@ -5961,6 +5971,16 @@ size_t mspace_usable_size(const void* mem) {
   return 0;
 }
 
+#if FOOTERS
+mspace mspace_of(const void* mem) {
+  mchunkptr p = mem2chunk(mem);
+  mstate fm = get_mstate_for(p);
+  if (!ok_magic(fm) || !ok_inuse(p))
+    return 0;
+  return (mspace)fm;
+}
+#endif /* FOOTERS */
+
 int mspace_mallopt(int param_number, int value) {
   return change_mparam(param_number, value);
 }
@@ -0,0 +1,117 @@
+#ifndef MORECORE_RESERVED_H_
+#define MORECORE_RESERVED_H_
+
+/* A MORECORE for dlmalloc.c that gives it one contiguous heap without
+ * brk. On first use we reserve MORECORE_RESERVE bytes of address space,
+ * PROT_NONE, and thereafter move a break up and down within it, as sbrk
+ * does: pages below the break are made accessible as it rises, and
+ * replaced with fresh PROT_NONE ones (so no longer counting as committed)
+ * as it falls. dlmalloc then sees one segment, growing and shrinking
+ * only at the top, so any free chunks in it can coalesce, and it can be
+ * trimmed.
+ *
+ * Include this into dlmalloc.c (e.g. with -include), which will then
+ * find MORECORE defined. dlmalloc makes all its MORECORE calls under its
+ * global lock, so we need no locking of our own. If the reservation
+ * fails, or is used up, we fail as sbrk would, and dlmalloc falls back
+ * to mmap. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* as dlmalloc.c does, for mremap */
+#endif
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#ifndef MORECORE_RESERVE
+#define MORECORE_RESERVE (sizeof (void *) == 8 ? (1ul<<36) : (1ul<<28))
+#endif
+/* dlmalloc asks for a contiguous MORECORE's memory a page or so at a time,
+ * so we change protections in bigger steps, keeping up to two steps'
+ * worth accessible above the break. A power of two, at least a page. */
+#ifndef MORECORE_COMMIT_STEP
+#define MORECORE_COMMIT_STEP (1ul<<20)
+#endif
+/* Unlike mmap'd segments, our heap can always be trimmed, and each trim
+ * costs a page fault per page when the heap regrows. At dlmalloc's 2MB
+ * default, freeing a batch of large chunks trims it, and the next batch
+ * faults it all back in: bench's 65536-byte case ran at half its speed
+ * or worse. So trim only once the top is bigger than any working set we
+ * cycle through. */
+#ifndef DEFAULT_TRIM_THRESHOLD
+#define DEFAULT_TRIM_THRESHOLD ((size_t) 256U << 20)
+#endif
+
+struct reserved_heap
+{
+	char *base;  /* NULL until we've reserved; (char *) -1 if that failed */
+	char *end;
+	char *brk;
+	char *committed; /* step-aligned; everything below is accessible */
+};
+static struct reserved_heap reserved_heap;
+
+static int reserved_heap_init(struct reserved_heap *h)
+{
+	if (h->base) return h->base != (char *) -1;
+	void *base = mmap(NULL, MORECORE_RESERVE, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) { h->base = (char *) -1; return 0; }
+	h->base = h->brk = h->committed = base;
+	h->end = h->base + MORECORE_RESERVE;
+	return 1;
+}
+
+static char *reserved_heap_step_up(struct reserved_heap *h, char *p)
+{
+	char *up = (char *) (((uintptr_t) p + MORECORE_COMMIT_STEP - 1) & ~(uintptr_t) (MORECORE_COMMIT_STEP - 1));
+	return up > h->end ? h->end : up;
+}
+
+static void *reserved_morecore(ptrdiff_t increment)
+{
+	struct reserved_heap *h = &reserved_heap;
+	if (!reserved_heap_init(h)) return (void *) -1;
+	char *old_brk = h->brk;
+	if (increment > 0)
+	{
+		if (increment > h->end - old_brk) return (void *) -1;
+		char *new_brk = old_brk + increment;
+		if (new_brk > h->committed)
+		{
+			char *new_committed = reserved_heap_step_up(h, new_brk);
+			if (0 != mprotect(h->committed, new_committed - h->committed,
+					PROT_READ | PROT_WRITE)) return (void *) -1;
+			h->committed = new_committed;
+		}
+		h->brk = new_brk;
+	}
+	else if (increment < 0)
+	{
+		if (-increment > old_brk - h->base) return (void *) -1;
+		char *new_brk = old_brk + increment;
+		/* Keep a step beyond the one the break is in, so that a heap
+		 * trimmed and then regrown by a little doesn't fault its pages
+		 * back in each time. */
+		char *new_committed = reserved_heap_step_up(h, new_brk);
+		new_committed = h->end - new_committed > MORECORE_COMMIT_STEP
+			? new_committed + MORECORE_COMMIT_STEP : h->end;
+		if (new_committed < h->committed)
+		{
+			/* Mapping over the pages drops them and their commit charge
+			 * at once, and keeps the address space ours. */
+			if (MAP_FAILED == mmap(new_committed, h->committed - new_committed, PROT_NONE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0))
+				return (void *) -1;
+			h->committed = new_committed;
+		}
+		h->brk = new_brk;
+	}
+	return old_brk;
+}
+
+#ifndef MORECORE
+#define MORECORE reserved_morecore
+#endif
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef MALLOCHOOKS_CHAIN_HPP_
+#define MALLOCHOOKS_CHAIN_HPP_
+
+/* A hook chain composed at compile time, for C++ clients.
+ *
+ * Built from separate objects by rules.mk, each hook is an out-of-line
+ * call that the compiler cannot see through. Here instead each stage is a
+ * class whose hooks are static inline member functions, calling the next
+ * stage's by name, so that the whole chain can inline into user2hook.c's
+ * entry points. The hooks are those of hookapi.h, with the same arguments.
+ *
+ * A non-terminal stage is a class template over the next stage, wrapped
+ * with layer<>. Deriving from pass_through<Next> means it need define only
+ * the hooks it cares about. The final stage is a terminal. For example:
+ *
+ *   template <class Next> struct count_mallocs : mallochooks::pass_through<Next>
+ *   {
+ *     static unsigned long n;
+ *     static void *malloc(size_t size, const void *caller)
+ *     { ++n; return Next::malloc(size, caller); }
+ *   };
+ *   template <class Next> unsigned long count_mallocs<Next>::n;
+ *
+ *   typedef mallochooks::chain<
+ *     mallochooks::layer<count_mallocs>,
+ *     mallochooks::terminal_direct
+ *   > my_chain;
+ *
+ * Then, in one source file, generate user2hook.c's entry points from it:
+ *
+ *   #define HOOK_PREFIX(m) my_chain_hook_ ## m
+ *   MALLOCHOOKS_DEFINE_HOOKS(my_chain)
+ *   extern "C" {
+ *   #include "user2hook.c"
+ *   }
+ *
+ * compiled with -I for our src/ as well as include/. The usual
+ * MALLOC_PREFIX, MALLOC_ATTRIBUTES etc. apply to user2hook.c as before.
+ * Compile that file with -fno-builtin too: otherwise the compiler assumes
+ * that malloc cannot touch the program's own variables, such as n above,
+ * and may read them across a call to it, inlined or not.
+ */
+
+#include <cstddef>
+#include <cstdlib>
+#include "mallochooks/goodsize.h"
+
+namespace mallochooks
+{
+	/* Passes every hook to the next stage. */
+	template <class Next>
+	struct pass_through
+	{
+		typedef Next next;
+		static inline void init()
+		{ Next::init(); }
+		static inline void *malloc(std::size_t size, const void *caller)
+		{ return Next::malloc(size, caller); }
+		static inline void *calloc(std::size_t nmemb, std::size_t size, const void *caller)
+		{ return Next::calloc(nmemb, size, caller); }
+		static inline void free(void *ptr, const void *caller)
+		{ Next::free(ptr, caller); }
+		static inline void free_sized(void *ptr, std::size_t size, const void *caller)
+		{ Next::free_sized(ptr, size, caller); }
+		static inline void *realloc(void *ptr, std::size_t size, const void *caller)
+		{ return Next::realloc(ptr, size, caller); }
+		static inline void *realloc_in_place(void *ptr, std::size_t size, const void *caller)
+		{ return Next::realloc_in_place(ptr, size, caller); }
+		static inline void **malloc_batch(std::size_t n, const std::size_t *sizes, void **out, const void *caller)
+		{ return Next::malloc_batch(n, sizes, out, caller); }
+		static inline void free_batch(void *const *ptrs, std::size_t n, const void *caller)
+		{ Next::free_batch(ptrs, n, caller); }
+		static inline void *memalign(std::size_t alignment, std::size_t size, const void *caller)
+		{ return Next::memalign(alignment, size, caller); }
+		static inline std::size_t malloc_usable_size(void *ptr)
+		{ return Next::malloc_usable_size(ptr); }
+		static inline std::size_t good_size(std::size_t size, std::size_t alignment, const void *caller)
+		{ return Next::good_size(size, alignment, caller); }
+	};
+
+	/* Makes a stage of a layer template, for chain<>. */
+	template <template <class> class Layer>
+	struct layer
+	{
+		template <class Next> using over = Layer<Next>;
+	};
+
+	/* chain<S1, S2, ..., T> is S1 over S2 over ... over the terminal T. */
+	template <class... Stages> struct chain;
+	template <class Terminal>
+	struct chain<Terminal> : Terminal {};
+	template <class First, class... Rest>
+	struct chain<First, Rest...> : First::template over<chain<Rest...> > {};
+}
+
+/* A terminal that calls a separately built C terminal (terminal-direct.c,
+ * terminal-indirect-dlsym.c, ...) by its usual __terminal_hook_* names.
+ * Those calls are out of line unless built with LTO. */
+#pragma push_macro("HOOK_PREFIX")
+#undef HOOK_PREFIX
+#define HOOK_PREFIX(m) __terminal_hook_ ## m
+extern "C" {
+#include "mallochooks/hookapi.h"
+}
+#pragma pop_macro("HOOK_PREFIX")
+namespace mallochooks
+{
+	struct terminal_hooks
+	{
+		static inline void init()
+		{ __terminal_hook_init(); }
+		static inline void *malloc(std::size_t size, const void *caller)
+		{ return __terminal_hook_malloc(size, caller); }
+		static inline void *calloc(std::size_t nmemb, std::size_t size, const void *caller)
+		{ return __terminal_hook_calloc(nmemb, size, caller); }
+		static inline void free(void *ptr, const void *caller)
+		{ __terminal_hook_free(ptr, caller); }
+		static inline void free_sized(void *ptr, std::size_t size, const void *caller)
+		{ __terminal_hook_free_sized(ptr, size, caller); }
+		static inline void *realloc(void *ptr, std::size_t size, const void *caller)
+		{ return __terminal_hook_realloc(ptr, size, caller); }
+		static inline void *realloc_in_place(void *ptr, std::size_t size, const void *caller)
+		{ return __terminal_hook_realloc_in_place(ptr, size, caller); }
+		static inline void **malloc_batch(std::size_t n, const std::size_t *sizes, void **out, const void *caller)
+		{ return __terminal_hook_malloc_batch(n, sizes, out, caller); }
+		static inline void free_batch(void *const *ptrs, std::size_t n, const void *caller)
+		{ __terminal_hook_free_batch(ptrs, n, caller); }
+		static inline void *memalign(std::size_t alignment, std::size_t size, const void *caller)
+		{ return __terminal_hook_memalign(alignment, size, caller); }
+		static inline std::size_t malloc_usable_size(void *ptr)
+		{ return __terminal_hook_malloc_usable_size(ptr); }
+		static inline std::size_t good_size(std::size_t size, std::size_t alignment, const void *caller)
+		{ return __terminal_hook_good_size(size, alignment, caller); }
+	};
+}
+
+/* A terminal that calls a real malloc directly, as terminal-direct.c
+ * does, by default under the __real_ names that rules.mk's --wrap gives
+ * it. (MALLOC_PREFIX is user2hook.c's, so we have our own macro.) */
+#ifndef MALLOCHOOKS_REAL
+#define MALLOCHOOKS_REAL(m) __real_ ## m
+#endif
+extern "C" {
+void *MALLOCHOOKS_REAL(malloc)(std::size_t size);
+void *MALLOCHOOKS_REAL(calloc)(std::size_t nmemb, std::size_t size);
+void MALLOCHOOKS_REAL(free)(void *ptr);
+#ifdef MALLOC_HAS_FREE_SIZED
+void MALLOCHOOKS_REAL(free_sized)(void *ptr, std::size_t size);
+#endif
+void *MALLOCHOOKS_REAL(realloc)(void *ptr, std::size_t size);
+#ifdef MALLOC_HAS_REALLOC_IN_PLACE
+void *MALLOCHOOKS_REAL(realloc_in_place)(void *ptr, std::size_t size);
+#endif
+void *MALLOCHOOKS_REAL(memalign)(std::size_t boundary, std::size_t size);
+std::size_t MALLOCHOOKS_REAL(malloc_usable_size)(void *ptr);
+/* dlmalloc's bulk calls, if MALLOC_HAS_BULK_ALLOC; as in terminal-direct.c,
+ * these keep their own names. */
+#ifdef MALLOC_HAS_BULK_ALLOC
+#ifndef MALLOC_BULK_PREFIX
+#define MALLOC_BULK_PREFIX(m) m
+#endif
+void **MALLOC_BULK_PREFIX(independent_comalloc)(std::size_t n, std::size_t *sizes, void **chunks);
+std::size_t MALLOC_BULK_PREFIX(bulk_free)(void **array, std::size_t n);
+#endif
+}
+#ifndef MALLOC_CHUNK_OVERHEAD
+#define MALLOC_CHUNK_OVERHEAD sizeof (std::size_t)
+#endif
+namespace mallochooks
+{
+	struct terminal_direct
+	{
+		static inline void init() {}
+		static inline void *malloc(std::size_t size, const void *)
+		{ return MALLOCHOOKS_REAL(malloc)(size); }
+		static inline void *calloc(std::size_t nmemb, std::size_t size, const void *)
+		{ return MALLOCHOOKS_REAL(calloc)(nmemb, size); }
+		static inline void free(void *ptr, const void *)
+		{ MALLOCHOOKS_REAL(free)(ptr); }
+		static inline void free_sized(void *ptr, std::size_t size, const void *)
+		{
+			/* Only some mallocs have a sized free; dlmalloc does not. */
+#ifdef MALLOC_HAS_FREE_SIZED
+			MALLOCHOOKS_REAL(free_sized)(ptr, size);
+#else
+			(void) size;
+			MALLOCHOOKS_REAL(free)(ptr);
+#endif
+		}
+		static inline void *realloc(void *ptr, std::size_t size, const void *)
+		{ return MALLOCHOOKS_REAL(realloc)(ptr, size); }
+		static inline void *realloc_in_place(void *ptr, std::size_t size, const void *)
+		{
+			/* dlmalloc has one; otherwise we can only use the chunk's slack. */
+#ifdef MALLOC_HAS_REALLOC_IN_PLACE
+			return MALLOCHOOKS_REAL(realloc_in_place)(ptr, size);
+#else
+			return ptr && MALLOCHOOKS_REAL(malloc_usable_size)(ptr) >= size ? ptr : 0;
+#endif
+		}
+		static inline void **malloc_batch(std::size_t n, const std::size_t *sizes, void **out, const void *)
+		{
+#ifdef MALLOC_HAS_BULK_ALLOC
+			return MALLOC_BULK_PREFIX(independent_comalloc)(n, const_cast<std::size_t *>(sizes), out);
+#else
+			for (std::size_t i = 0; i < n; ++i)
+			{
+				if (!(out[i] = MALLOCHOOKS_REAL(malloc)(sizes[i])))
+				{
+					while (i > 0) MALLOCHOOKS_REAL(free)(out[--i]);
+					return 0;
+				}
+			}
+			return out;
+#endif
+		}
+		static inline void free_batch(void *const *ptrs, std::size_t n, const void *)
+		{
+#ifdef MALLOC_HAS_BULK_ALLOC
+			/* bulk_free writes to its array, so give it a copy. */
+			void *group[64];
+			for (std::size_t done = 0; done < n; done += 64)
+			{
+				std::size_t k = n - done < 64 ? n - done : 64;
+				for (std::size_t i = 0; i < k; ++i) group[i] = ptrs[done + i];
+				if (MALLOC_BULK_PREFIX(bulk_free)(group, k))
+				{
+					for (std::size_t i = 0; i < k; ++i) if (group[i]) MALLOCHOOKS_REAL(free)(group[i]);
+				}
+			}
+#else
+			for (std::size_t i = 0; i < n; ++i) MALLOCHOOKS_REAL(free)(ptrs[i]);
+#endif
+		}
+		static inline void *memalign(std::size_t boundary, std::size_t size, const void *)
+		{ return MALLOCHOOKS_REAL(memalign)(boundary, size); }
+		static inline std::size_t malloc_usable_size(void *ptr)
+		{ return MALLOCHOOKS_REAL(malloc_usable_size)(ptr); }
+		static inline std::size_t good_size(std::size_t size, std::size_t alignment, const void *)
+		{
+			/* As in terminal-direct.c: work it out for dlmalloc, else ask. */
+#ifdef MALLOC_HAS_DLMALLOC_PADDING
+			(void) alignment;
+			return mallochooks_dlmalloc_good_size(size, MALLOC_CHUNK_OVERHEAD);
+#else
+			return mallochooks_probe_good_size(size, alignment, MALLOCHOOKS_REAL(malloc),
+				MALLOCHOOKS_REAL(malloc_usable_size), MALLOCHOOKS_REAL(free));
+#endif
+		}
+	};
+}
+
+/* Define the hook API (hookapi.h), under the current HOOK_PREFIX, as the
+ * given chain, e.g. for user2hook.c to call. The definitions are hidden
+ * and in the same translation unit as their callers, so they inline. */
+#define MALLOCHOOKS_DEFINE_HOOKS(Chain) \
+extern "C" { \
+	__attribute__((visibility("hidden"))) void HOOK_PREFIX(init)(void) \
+	{ Chain::init(); } \
+	__attribute__((visibility("hidden"))) void *HOOK_PREFIX(malloc)(size_t size, const void *caller) \
+	{ return Chain::malloc(size, caller); } \
+	__attribute__((visibility("hidden"))) void *HOOK_PREFIX(calloc)(size_t nmemb, size_t size, const void *caller) \
+	{ return Chain::calloc(nmemb, size, caller); } \
+	__attribute__((visibility("hidden"))) void HOOK_PREFIX(free)(void *ptr, const void *caller) \
+	{ Chain::free(ptr, caller); } \
+	__attribute__((visibility("hidden"))) void HOOK_PREFIX(free_sized)(void *ptr, size_t size, const void *caller) \
+	{ Chain::free_sized(ptr, size, caller); } \
+	__attribute__((visibility("hidden"))) void *HOOK_PREFIX(realloc)(void *ptr, size_t size, const void *caller) \
+	{ return Chain::realloc(ptr, size, caller); } \
+	__attribute__((visibility("hidden"))) void *HOOK_PREFIX(realloc_in_place)(void *ptr, size_t size, const void *caller) \
+	{ return Chain::realloc_in_place(ptr, size, caller); } \
+	__attribute__((visibility("hidden"))) void **HOOK_PREFIX(malloc_batch)(size_t n, const size_t *sizes, void **out, const void *caller) \
+	{ return Chain::malloc_batch(n, sizes, out, caller); } \
+	__attribute__((visibility("hidden"))) void HOOK_PREFIX(free_batch)(void *const *ptrs, size_t n, const void *caller) \
+	{ Chain::free_batch(ptrs, n, caller); } \
+	__attribute__((visibility("hidden"))) void *HOOK_PREFIX(memalign)(size_t alignment, size_t size, const void *caller) \
+	{ return Chain::memalign(alignment, size, caller); } \
+	__attribute__((visibility("hidden"))) size_t HOOK_PREFIX(malloc_usable_size)(void *ptr) \
+	{ return Chain::malloc_usable_size(ptr); } \
+	__attribute__((visibility("hidden"))) size_t HOOK_PREFIX(good_size)(size_t size, size_t alignment, const void *caller) \
+	{ return Chain::good_size(size, alignment, caller); } \
+}
+
+#endif
@@ -16,10 +16,21 @@
 
 /* Prototypes for the event callbacks (formerly "high-level hooks"). */
 void ALLOC_EVENT(post_init)(void) ALLOC_EVENT_ATTRIBUTES;
+// Unless hook2event is built with PRE_ALLOC_PRESERVES_SIZE (saying that
+// pre_alloc never changes *p_size), pre_alloc is also called for a
+// good_size query, as if for the allocation it asks about.
 void ALLOC_EVENT(pre_alloc)(size_t *p_size, size_t *p_alignment, const void *caller) ALLOC_EVENT_ATTRIBUTES;
 void ALLOC_EVENT(post_successful_alloc)(void *allocated, size_t modified_size, size_t modified_alignment, 
 	size_t requested_size, size_t requested_alignment, const void *caller) ALLOC_EVENT_ATTRIBUTES;
-// Return non-zero => cancel the free call
+// Return non-zero => cancel the free call.
+// For a sized free (free_sized, sized operator delete), freed_usable_size
+// is the size the caller passed if hook2event is built with
+// PRE_ALLOC_PRESERVES_SIZE, or without a pre_alloc handler; otherwise it
+// is the chunk's usable size, as for free. So the default build, which has
+// a pre_alloc, still turns a sized free into a free, and pays for the
+// usable-size query that the size was meant to save; only the other two
+// pass the size along. (The C++ sized deletes reach us at all only if
+// rules.mk is given MALLOCHOOKS_SIZED_DELETE.)
 int ALLOC_EVENT(pre_nonnull_free)(void *userptr, size_t freed_usable_size) ALLOC_EVENT_ATTRIBUTES;
 void ALLOC_EVENT(post_nonnull_free)(void *userptr) ALLOC_EVENT_ATTRIBUTES;
 void ALLOC_EVENT(pre_nonnull_nonzero_realloc)(void *userptr, size_t size, const void *caller) ALLOC_EVENT_ATTRIBUTES;
@@ -27,5 +38,28 @@ void ALLOC_EVENT(post_nonnull_nonzero_realloc)(void *userptr,
 	size_t modified_size, 
 	size_t old_usable_size, 
 	const void *caller, void *__new) ALLOC_EVENT_ATTRIBUTES;
+// A chunk grown (or shrunk) by realloc_in_place, which never moves it.
+// This one is opt-in: hook2event dispatches it only if built with
+// HAVE_ALLOC_EVENT_post_realloc_in_place (e.g. via MALLOCHOOKS_EVENTS).
+// Otherwise a realloc_in_place is reported as a bona fide realloc, whose
+// __new is either userptr or (if it could not be done) NULL.
+void ALLOC_EVENT(post_realloc_in_place)(void *userptr,
+	size_t modified_size,
+	size_t old_usable_size,
+	const void *caller) ALLOC_EVENT_ATTRIBUTES;
+// Also opt-in: a malloc_batch or free_batch reported as one event (per
+// group of at most ALLOC_EVENT_BATCH_GROUP chunks) instead of one event per
+// chunk. Only the sampled chunks are reported, and only those not
+// cancelled by pre_nonnull_free, which is still called per chunk.
+void ALLOC_EVENT(post_successful_alloc_batch)(size_t n, void *const *allocated,
+	const size_t *modified_sizes, const size_t *requested_sizes,
+	const void *caller) ALLOC_EVENT_ATTRIBUTES;
+void ALLOC_EVENT(post_nonnull_free_batch)(void *const *userptrs, size_t n) ALLOC_EVENT_ATTRIBUTES;
+
+/* If hook2event is built with ALLOC_EVENT_TRANSPORT_RING, the post_*
+ * events run later, on a background thread (see src/event-ring.inc.c).
+ * These let the handlers' side see how far behind it is. */
+size_t alloc_event_ring_dropped(void) ALLOC_EVENT_ATTRIBUTES;
+void alloc_event_ring_flush(void) ALLOC_EVENT_ATTRIBUTES;
 
 #endif
@@ -0,0 +1,54 @@
+#ifndef MALLOCHOOKS_GOODSIZE_H_
+#define MALLOCHOOKS_GOODSIZE_H_
+
+#include <stddef.h>
+
+/* Helpers for terminals answering good_size (see hookapi.h). Both give a
+ * lower bound on what the allocation would really get, so a caller can
+ * always use that much of the chunk. */
+
+/* dlmalloc's padding rules, which glibc's malloc shares: a chunk is the
+ * request plus 'overhead', rounded up to two words and at least four
+ * words, and all of it but the overhead is usable. The overhead is one
+ * word, or two if dlmalloc is built with FOOTERS. A memalign'd or mmap'd
+ * chunk may get more than this, but never less. */
+static inline size_t mallochooks_dlmalloc_good_size(size_t size, size_t overhead)
+{
+	const size_t align = 2 * sizeof (size_t);
+	const size_t min_chunk = 4 * sizeof (size_t);
+	size_t chunk = (size + overhead + align - 1) & ~(align - 1);
+	if (chunk < size) return size; /* overflowed */
+	if (chunk < min_chunk) chunk = min_chunk;
+	return chunk - overhead;
+}
+
+/* For a malloc we know nothing about, ask it. Once per bucket of
+ * MALLOCHOOKS_GOOD_SIZE_STEP bytes, we allocate the smallest size in the
+ * bucket and remember what it got; a bigger request should get no less,
+ * so that does for the whole bucket. Beyond the table, or for more than
+ * the step's alignment, we only know the size itself. */
+#ifndef MALLOCHOOKS_GOOD_SIZE_PROBE_MAX
+#define MALLOCHOOKS_GOOD_SIZE_PROBE_MAX 4096
+#endif
+#define MALLOCHOOKS_GOOD_SIZE_STEP 16
+static inline size_t mallochooks_probe_good_size(size_t size, size_t alignment,
+	void *(*alloc)(size_t), size_t (*usable)(void *), void (*release)(void *))
+{
+	static size_t probed[MALLOCHOOKS_GOOD_SIZE_PROBE_MAX / MALLOCHOOKS_GOOD_SIZE_STEP];
+	if (size == 0 || size > MALLOCHOOKS_GOOD_SIZE_PROBE_MAX
+			|| alignment > MALLOCHOOKS_GOOD_SIZE_STEP) return size;
+	size_t i = (size - 1) / MALLOCHOOKS_GOOD_SIZE_STEP;
+	size_t good = __atomic_load_n(&probed[i], __ATOMIC_RELAXED);
+	if (!good)
+	{
+		void *chunk = alloc(i * MALLOCHOOKS_GOOD_SIZE_STEP + 1);
+		if (!chunk) return size;
+		good = usable(chunk);
+		release(chunk);
+		/* Racing probes store the same answer. */
+		__atomic_store_n(&probed[i], good, __ATOMIC_RELAXED);
+	}
+	return good > size ? good : size;
+}
+
+#endif
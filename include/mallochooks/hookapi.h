@@ -12,15 +12,31 @@
 #endif
 
 /* The hook API is like the malloc API except
- * - no calloc() -- it is emulated using malloc
- * - no posix_memalign() -- it is emulated using memalign
+ * - no posix_memalign(), aligned_alloc(), valloc() or pvalloc() -- they
+ *   are emulated using memalign
+ * - no free_aligned_sized() or sized operator delete -- they become free_sized()
  * - extra 'caller' arguments at the end
- * - extra init() function.
+ * - extra init() function
+ * - extra realloc_in_place(), which resizes a chunk without moving it and
+ *   returns it, or else returns NULL having changed nothing (as dlmalloc's
+ *   does)
+ * - extra malloc_batch() and free_batch(), for many chunks at once;
+ *   malloc_batch() allocates all of them, returning out, or none of them,
+ *   returning NULL; free_batch() skips nulls and leaves its array alone.
+ * - extra good_size(), which says how much of a chunk a malloc (alignment
+ *   0) or memalign of this size could use, without allocating one: at
+ *   least size, and no more than malloc_usable_size would say
  */
 
 void HOOK_PREFIX(init)(void) HOOK_ATTRIBUTES(init);
 void *HOOK_PREFIX(malloc)(size_t size, const void *caller) HOOK_ATTRIBUTES(malloc);
+void *HOOK_PREFIX(calloc)(size_t nmemb, size_t size, const void *caller) HOOK_ATTRIBUTES(calloc);
 void HOOK_PREFIX(free)(void *ptr, const void *caller) HOOK_ATTRIBUTES(free);
+void HOOK_PREFIX(free_sized)(void *ptr, size_t size, const void *caller) HOOK_ATTRIBUTES(free_sized);
 void *HOOK_PREFIX(realloc)(void *ptr, size_t size, const void *caller) HOOK_ATTRIBUTES(realloc);
+void *HOOK_PREFIX(realloc_in_place)(void *ptr, size_t size, const void *caller) HOOK_ATTRIBUTES(realloc_in_place);
+void **HOOK_PREFIX(malloc_batch)(size_t n, const size_t *sizes, void **out, const void *caller) HOOK_ATTRIBUTES(malloc_batch);
+void HOOK_PREFIX(free_batch)(void *const *ptrs, size_t n, const void *caller) HOOK_ATTRIBUTES(free_batch);
 void *HOOK_PREFIX(memalign)(size_t alignment, size_t size, const void *caller) HOOK_ATTRIBUTES(memalign);
 size_t HOOK_PREFIX(malloc_usable_size)(void*) HOOK_ATTRIBUTES(malloc_usable_size);
+size_t HOOK_PREFIX(good_size)(size_t size, size_t alignment, const void *caller) HOOK_ATTRIBUTES(good_size);
@@ -0,0 +1,27 @@
+#ifndef MALLOCHOOKS_PROFILE_H_
+#define MALLOCHOOKS_PROFILE_H_
+
+#include <stddef.h>
+
+/* What the callsite-profile hook (src/callsite-profile.c) has seen
+ * allocated at one call site. 'caller' is the hooks' caller argument,
+ * i.e. normally the return address of the call to malloc (or calloc, ...). */
+struct callsite_stats
+{
+	const void *caller;
+	long live_bytes;
+	long live_count;
+	unsigned long total_allocs;
+	unsigned long total_bytes;
+};
+
+/* Call 'cb' once per call site seen so far, with its totals over all
+ * threads. The counters keep moving while we do this, so the picture is
+ * not an atomic snapshot. Nothing here calls malloc. */
+void callsite_profile_foreach(void (*cb)(const struct callsite_stats *s, void *arg), void *arg)
+	__attribute__((visibility("hidden")));
+/* Write one text line per call site to fd, followed by the number of
+ * chunks we could not track because the chunk table was full. */
+void callsite_profile_dump(int fd) __attribute__((visibility("hidden")));
+
+#endif
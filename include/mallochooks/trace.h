@@ -0,0 +1,162 @@
+#ifndef MALLOCHOOKS_TRACE_H_
+#define MALLOCHOOKS_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The file format written by the trace hook (src/trace.c).
+ *
+ * A trace file is a struct trace_file_header followed by fixed-size
+ * blocks of TRACE_BLOCK_SIZE bytes. Each block belongs to one thread, and
+ * starts with a struct trace_block_header, whose 'used' says how many
+ * bytes of records follow it; the rest of the block is unused. A thread
+ * claims a new block when its current one fills up.
+ *
+ * A record is one byte of op and flags, then a sequence of unsigned LEB128
+ * varints. Addresses and callers are delta-encoded against the previous
+ * record in the same block (zigzag, so that they can go backwards), and
+ * so are timestamps (as plain unsigned deltas, starting from the block's
+ * base_ticks). So each block decodes on its own.
+ *
+ *   op byte:   bits 0-2 the op, bit 3 TRACE_SAME_CALLER
+ *   ticks:     delta since the previous record
+ *   then, by op:
+ *     MALLOC, CALLOC:  address, size
+ *     MEMALIGN:        address, size, alignment
+ *     FREE:            address
+ *     FREE_SIZED:      address, size
+ *     REALLOC:         old address, new address (delta from old), size
+ *   caller:    unless TRACE_SAME_CALLER
+ *
+ * A failed allocation is recorded with address 0. The previous address,
+ * for the next record's delta, is the last one written (for a realloc,
+ * the new one).
+ *
+ * Ticks are TSC ticks if the header says TRACE_TICKS_TSC, nanoseconds of
+ * CLOCK_MONOTONIC otherwise. The header records both clocks when the trace
+ * started and (if the process exited normally) stopped, for conversion.
+ */
+
+#define TRACE_MAGIC "MHTRACE1"
+#define TRACE_BLOCK_SIZE (64u * 1024)
+#define TRACE_MAX_RECORD 64 /* 1 + 5 * 10, rounded up */
+
+enum trace_op
+{
+	TRACE_MALLOC = 0,
+	TRACE_CALLOC,
+	TRACE_MEMALIGN,
+	TRACE_FREE,
+	TRACE_FREE_SIZED,
+	TRACE_REALLOC
+};
+#define TRACE_OP_MASK 0x7
+#define TRACE_SAME_CALLER 0x8
+
+#define TRACE_TICKS_TSC 0x1
+
+struct trace_file_header
+{
+	char magic[8];
+	uint32_t flags;
+	uint32_t block_size;
+	uint64_t start_ns, start_ticks;
+	uint64_t stop_ns, stop_ticks; /* zero if the process didn't exit normally */
+	uint64_t nblocks;             /* blocks claimed; may overcount, so trust the file size */
+	uint64_t dropped;             /* records lost because the file was full */
+};
+
+struct trace_block_header
+{
+	uint32_t used;
+	uint32_t tid;
+	uint64_t base_ticks;
+};
+
+/* One decoded record. */
+struct trace_record
+{
+	enum trace_op op;
+	uint64_t ticks;
+	uintptr_t addr;
+	uintptr_t new_addr; /* realloc only */
+	size_t size;
+	size_t alignment;   /* memalign only */
+	uintptr_t caller;
+};
+
+static inline uint64_t trace_zigzag(int64_t v)
+{
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+static inline int64_t trace_unzigzag(uint64_t v)
+{
+	return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static inline unsigned char *trace_put_varint(unsigned char *pos, uint64_t v)
+{
+	while (v >= 0x80)
+	{
+		*pos++ = (unsigned char) v | 0x80;
+		v >>= 7;
+	}
+	*pos++ = (unsigned char) v;
+	return pos;
+}
+static inline const unsigned char *trace_get_varint(const unsigned char *pos, uint64_t *out)
+{
+	uint64_t v = 0;
+	unsigned shift = 0;
+	unsigned char b;
+	do
+	{
+		b = *pos++;
+		v |= (uint64_t) (b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	*out = v;
+	return pos;
+}
+
+/* The delta state, per block. */
+struct trace_cursor
+{
+	uint64_t ticks;
+	uintptr_t addr;
+	uintptr_t caller;
+};
+static inline void trace_cursor_init(struct trace_cursor *c, const struct trace_block_header *b)
+{
+	c->ticks = b->base_ticks;
+	c->addr = 0;
+	c->caller = 0;
+}
+
+/* Decode one record at pos, returning the position after it. */
+static inline const unsigned char *trace_decode(const unsigned char *pos,
+	struct trace_cursor *c, struct trace_record *r)
+{
+	uint64_t v;
+	unsigned char opbyte = *pos++;
+	r->op = (enum trace_op) (opbyte & TRACE_OP_MASK);
+	pos = trace_get_varint(pos, &v); c->ticks += v; r->ticks = c->ticks;
+	pos = trace_get_varint(pos, &v); c->addr += trace_unzigzag(v); r->addr = c->addr;
+	r->new_addr = 0;
+	r->size = 0;
+	r->alignment = 0;
+	if (r->op == TRACE_REALLOC)
+	{
+		pos = trace_get_varint(pos, &v); c->addr += trace_unzigzag(v); r->new_addr = c->addr;
+	}
+	if (r->op != TRACE_FREE) { pos = trace_get_varint(pos, &v); r->size = v; }
+	if (r->op == TRACE_MEMALIGN) { pos = trace_get_varint(pos, &v); r->alignment = v; }
+	if (!(opbyte & TRACE_SAME_CALLER))
+	{
+		pos = trace_get_varint(pos, &v); c->caller += trace_unzigzag(v);
+	}
+	r->caller = c->caller;
+	return pos;
+}
+
+#endif
@@ -4,6 +4,20 @@
 #if !defined(MALLOC_PREFIX) && !defined(MALLOC_LINKAGE)
 /* Use the libc decls, which will get the attributes like 'nonnull' right. */
 #include <stdlib.h>
+/* C23 sized deallocation is not in every libc's stdlib.h yet. */
+void free_sized(void *ptr, size_t size);
+void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+/* Nor are these obsolete ones, except with _GNU_SOURCE (and malloc.h). */
+void *valloc(size_t size);
+void *pvalloc(size_t size);
+/* Only some mallocs (e.g. dlmalloc) have this, but we always do. */
+void *realloc_in_place(void *ptr, size_t size);
+/* Nobody else has these. */
+void **malloc_batch(size_t n, const size_t *sizes, void **out);
+void free_batch(void *const *ptrs, size_t n);
+/* Darwin has the first of these. */
+size_t malloc_good_size(size_t size);
+size_t memalign_good_size(size_t alignment, size_t size);
 #else
 	/* We have a malloc prefix or malloc linkage, and we need to use them, so
 	 * we cannot make do with libc's standard prototypes. */
@@ -19,8 +33,18 @@
 	MALLOC_LINKAGE void *MALLOC_PREFIX(malloc)(size_t size);
 	MALLOC_LINKAGE void *MALLOC_PREFIX(calloc)(size_t nmemb, size_t size);
 	MALLOC_LINKAGE void MALLOC_PREFIX(free)(void *ptr);
+	MALLOC_LINKAGE void MALLOC_PREFIX(free_sized)(void *ptr, size_t size);
+	MALLOC_LINKAGE void MALLOC_PREFIX(free_aligned_sized)(void *ptr, size_t alignment, size_t size);
 	MALLOC_LINKAGE void *MALLOC_PREFIX(realloc)(void *ptr, size_t size);
+	MALLOC_LINKAGE void *MALLOC_PREFIX(realloc_in_place)(void *ptr, size_t size);
+	MALLOC_LINKAGE void **MALLOC_PREFIX(malloc_batch)(size_t n, const size_t *sizes, void **out);
+	MALLOC_LINKAGE void MALLOC_PREFIX(free_batch)(void *const *ptrs, size_t n);
 	MALLOC_LINKAGE void *MALLOC_PREFIX(memalign)(size_t boundary, size_t size);
 	MALLOC_LINKAGE int MALLOC_PREFIX(posix_memalign)(void **memptr, size_t alignment, size_t size);
+	MALLOC_LINKAGE void *MALLOC_PREFIX(aligned_alloc)(size_t alignment, size_t size);
+	MALLOC_LINKAGE void *MALLOC_PREFIX(valloc)(size_t size);
+	MALLOC_LINKAGE void *MALLOC_PREFIX(pvalloc)(size_t size);
 	MALLOC_LINKAGE size_t MALLOC_PREFIX(malloc_usable_size)(void *ptr);
+	MALLOC_LINKAGE size_t MALLOC_PREFIX(malloc_good_size)(size_t size);
+	MALLOC_LINKAGE size_t MALLOC_PREFIX(memalign_good_size)(size_t alignment, size_t size);
 #endif
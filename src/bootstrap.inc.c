@@ -0,0 +1,105 @@
+/* A bootstrap allocator for terminal-indirect-dlsym.c, which serves from
+ * here any call that reaches it while it is already active on the same
+ * thread (e.g. dlsym or __tls_get_addr allocating while we look up the
+ * underlying malloc).
+ *
+ * Unlike liballocs's old early_malloc, we do not use a fixed pool that can
+ * run out and then spill into memory we don't recognise. Instead we reserve
+ * one large range of address space up front (MAP_NORESERVE, so untouched
+ * pages cost nothing), and only ever allocate within it. So any pointer is
+ * ours iff it is in that range, which is one subtraction and compare.
+ *
+ * Chunks are bump-allocated and never reused; reentrant calls are rare,
+ * so the waste is small. A chunk is preceded by a header recording its
+ * size. realloc of one of our chunks moves it to the underlying malloc,
+ * unless that call is itself reentrant. */
+
+#include <sys/mman.h>
+
+#ifndef BOOTSTRAP_RESERVE
+#define BOOTSTRAP_RESERVE (1ul<<30)
+#endif
+#define BOOTSTRAP_ALIGN 16
+
+struct bootstrap_header
+{
+	size_t size;
+	size_t offset; /* from the start of the chunk's space, for memalign */
+};
+
+/* Zero until the range is reserved, so that the check fails. */
+static uintptr_t bootstrap_begin;
+static uintptr_t bootstrap_limit;
+static uintptr_t bootstrap_cursor;
+
+static inline _Bool is_bootstrap_chunk(const void *ptr)
+{
+	return (uintptr_t) ptr - __atomic_load_n(&bootstrap_begin, __ATOMIC_RELAXED)
+		< __atomic_load_n(&bootstrap_limit, __ATOMIC_RELAXED);
+}
+
+static _Bool bootstrap_reserve(void)
+{
+	if (__atomic_load_n(&bootstrap_limit, __ATOMIC_ACQUIRE)) return 1;
+	void *range = mmap(NULL, BOOTSTRAP_RESERVE, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (range == MAP_FAILED) return 0;
+	uintptr_t expected = 0;
+	if (!__atomic_compare_exchange_n(&bootstrap_begin, &expected, (uintptr_t) range,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		/* Another thread won; wait for it to finish publishing. */
+		munmap(range, BOOTSTRAP_RESERVE);
+		while (!__atomic_load_n(&bootstrap_limit, __ATOMIC_ACQUIRE));
+		return 1;
+	}
+	__atomic_store_n(&bootstrap_cursor, (uintptr_t) range, __ATOMIC_RELAXED);
+	__atomic_store_n(&bootstrap_limit, BOOTSTRAP_RESERVE, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static void *bootstrap_memalign(size_t alignment, size_t size)
+{
+	if (alignment < BOOTSTRAP_ALIGN) alignment = BOOTSTRAP_ALIGN;
+	if (alignment & (alignment - 1)) { errno = EINVAL; return NULL; }
+	if (size > BOOTSTRAP_RESERVE || !bootstrap_reserve()) { errno = ENOMEM; return NULL; }
+	size_t space = ((sizeof (struct bootstrap_header) + size + BOOTSTRAP_ALIGN - 1)
+			& ~(size_t) (BOOTSTRAP_ALIGN - 1))
+		+ (alignment - BOOTSTRAP_ALIGN);
+	uintptr_t base = __atomic_fetch_add(&bootstrap_cursor, space, __ATOMIC_RELAXED);
+	if (base + space > bootstrap_begin + bootstrap_limit) { errno = ENOMEM; return NULL; }
+	uintptr_t user = (base + sizeof (struct bootstrap_header) + alignment - 1)
+		& ~(uintptr_t) (alignment - 1);
+	struct bootstrap_header *h = (struct bootstrap_header *) user - 1;
+	h->size = size;
+	h->offset = user - base;
+	/* Fresh from mmap, so already zeroed. */
+	return (void *) user;
+}
+
+static void *bootstrap_malloc(size_t size)
+{
+	return bootstrap_memalign(BOOTSTRAP_ALIGN, size);
+}
+
+static void *bootstrap_calloc(size_t nmemb, size_t size)
+{
+	size_t total;
+	if (__builtin_mul_overflow(nmemb, size, &total)) { errno = ENOMEM; return NULL; }
+	return bootstrap_malloc(total);
+}
+
+static size_t bootstrap_usable_size(const void *ptr)
+{
+	return ((const struct bootstrap_header *) ptr - 1)->size;
+}
+
+/* Allocate the new chunk with 'alloc', which may or may not be us. */
+static void *bootstrap_realloc(void *ptr, size_t size, void *(*alloc)(size_t))
+{
+	size_t old_size = bootstrap_usable_size(ptr);
+	if (size <= old_size && alloc == bootstrap_malloc) return ptr;
+	void *new_ptr = alloc(size);
+	if (new_ptr) memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+	return new_ptr;
+}
@@ -0,0 +1,406 @@
+/* A hook that keeps per-call-site allocation statistics, keyed by
+ * the 'caller' argument every hook receives. See mallochooks/profile.h
+ * for how to read them out.
+ *
+ * Nothing here takes a lock or calls malloc. Each thread counts into
+ * one of CALLSITE_SHARDS shards (threads are dealt out round-robin), so
+ * threads rarely share a counter's cache line; each shard is a fixed-size
+ * open-addressing table of call sites. To charge a free to the right
+ * site, every live chunk is entered in a second (global, lock-free,
+ * open-addressing) table mapping it to its site record and size. If that
+ * table is full, the chunk goes untracked; if a shard's site table is
+ * full, the site is counted in the shard's catch-all record, which is
+ * reported as caller 0. Removing a chunk leaves a tombstone, which is
+ * emptied once nothing after it is in use, so that lookups stay short. */
+
+#include <stdint.h>
+#include <unistd.h>   /* for write */
+#include <sys/mman.h>
+
+#ifndef OUR_HOOK
+#define OUR_HOOK(m) hook_ ## m
+#endif
+#ifndef NEXT_HOOK
+#define NEXT_HOOK(m) __terminal_hook_ ## m
+#endif
+
+/* Prototype the hooks we call... */
+#define HOOK_PREFIX(m) NEXT_HOOK(m)
+#include "mallochooks/hookapi.h"
+#undef HOOK_PREFIX
+/* ... and the ones we define. */
+#define HOOK_PREFIX(m) OUR_HOOK(m)
+#include "mallochooks/hookapi.h"
+#undef HOOK_PREFIX
+
+#include "mallochooks/profile.h"
+
+#ifndef CALLSITE_SHARDS
+#define CALLSITE_SHARDS 64
+#endif
+#ifndef CALLSITE_SLOTS_PER_SHARD
+#define CALLSITE_SLOTS_PER_SHARD 4096 /* power of two */
+#endif
+#ifndef CALLSITE_CHUNK_SLOTS
+#define CALLSITE_CHUNK_SLOTS (1ul<<22) /* power of two; 16 bytes each, reserved lazily */
+#endif
+#define CALLSITE_MAX_PROBES 32
+
+/* Each shard's table, followed by one catch-all record per shard. */
+#define CALLSITE_CATCHALL(shard) \
+	(&sites[CALLSITE_SHARDS * CALLSITE_SLOTS_PER_SHARD + (shard)])
+static struct callsite_stats sites[CALLSITE_SHARDS * (CALLSITE_SLOTS_PER_SHARD + 1)];
+
+/* A live chunk's entry packs its site record's index and its size. */
+#define CHUNK_SITE_BITS 24
+struct chunk_slot
+{
+	void *ptr;
+	uint64_t site_and_size;
+};
+#define CHUNK_SLOT_EMPTY ((void*) 0)
+#define CHUNK_SLOT_TOMBSTONE ((void*) 1)
+#define CHUNK_SLOT_LOCKED ((void*) 2) /* briefly, an empty slot no-one may fill */
+static struct chunk_slot *chunks;
+static unsigned long untracked;
+
+static unsigned next_shard;
+static __thread unsigned my_shard_plus_one __attribute__((tls_model("initial-exec")));
+
+static inline unsigned callsite_shard(void)
+{
+	if (__builtin_expect(!my_shard_plus_one, 0))
+	{
+		my_shard_plus_one = 1 + __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % CALLSITE_SHARDS;
+	}
+	return my_shard_plus_one - 1;
+}
+
+static inline uint64_t hash_ptr(const void *p)
+{
+	return ((uintptr_t) p >> 4) * 0x9E3779B97F4A7C15ull >> 20;
+}
+
+/* Find, or with 'create', make the caller's record in a shard. */
+static struct callsite_stats *site_lookup(unsigned shard, const void *caller, _Bool create)
+{
+	if (!caller) return create ? CALLSITE_CATCHALL(shard) : NULL;
+	struct callsite_stats *table = &sites[shard * CALLSITE_SLOTS_PER_SHARD];
+	uint64_t h = hash_ptr(caller);
+	for (unsigned i = 0; i < CALLSITE_MAX_PROBES; ++i)
+	{
+		struct callsite_stats *s = &table[(h + i) & (CALLSITE_SLOTS_PER_SHARD - 1)];
+		const void *seen = __atomic_load_n(&s->caller, __ATOMIC_ACQUIRE);
+		if (seen == caller) return s;
+		if (seen == NULL)
+		{
+			if (!create) return NULL;
+			if (__atomic_compare_exchange_n(&s->caller, &seen, caller,
+					0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+					|| seen == caller) return s;
+		}
+	}
+	return create ? CALLSITE_CATCHALL(shard) : NULL;
+}
+
+static struct chunk_slot *chunk_table(void)
+{
+	struct chunk_slot *table = __atomic_load_n(&chunks, __ATOMIC_ACQUIRE);
+	if (__builtin_expect(!table, 0))
+	{
+		struct chunk_slot *new_table = mmap(NULL, CALLSITE_CHUNK_SLOTS * sizeof (struct chunk_slot),
+			PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (new_table == MAP_FAILED) return NULL;
+		if (!__atomic_compare_exchange_n(&chunks, &table, new_table,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			munmap(new_table, CALLSITE_CHUNK_SLOTS * sizeof (struct chunk_slot));
+		}
+		else table = new_table;
+	}
+	return table;
+}
+
+/* A tombstone followed by an empty slot is on no chunk's probe sequence,
+ * so it can be emptied too, and so can any tombstones before it. We lock
+ * the empty slot meanwhile, so that no-one fills it first. */
+static void chunk_clear(struct chunk_slot *table, size_t pos)
+{
+	for (unsigned n = 0; n < CALLSITE_MAX_PROBES; ++n)
+	{
+		struct chunk_slot *next = &table[(pos + 1) & (CALLSITE_CHUNK_SLOTS - 1)];
+		void *expected = CHUNK_SLOT_EMPTY;
+		if (!__atomic_compare_exchange_n(&next->ptr, &expected, CHUNK_SLOT_LOCKED,
+				0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return;
+		expected = CHUNK_SLOT_TOMBSTONE;
+		_Bool cleared = __atomic_compare_exchange_n(&table[pos].ptr, &expected, CHUNK_SLOT_EMPTY,
+			0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+		__atomic_store_n(&next->ptr, CHUNK_SLOT_EMPTY, __ATOMIC_SEQ_CST);
+		if (!cleared) return;
+		pos = (pos - 1) & (CALLSITE_CHUNK_SLOTS - 1);
+		if (__atomic_load_n(&table[pos].ptr, __ATOMIC_RELAXED) != CHUNK_SLOT_TOMBSTONE) return;
+	}
+}
+
+static _Bool chunk_insert(void *ptr, uint64_t site_and_size)
+{
+	struct chunk_slot *table = chunk_table();
+	if (!table) return 0;
+	uint64_t h = hash_ptr(ptr);
+restart:
+	for (unsigned i = 0; i < CALLSITE_MAX_PROBES; ++i)
+	{
+		struct chunk_slot *slot = &table[(h + i) & (CALLSITE_CHUNK_SLOTS - 1)];
+		void *seen = __atomic_load_n(&slot->ptr, __ATOMIC_RELAXED);
+		while (seen == CHUNK_SLOT_EMPTY || seen == CHUNK_SLOT_TOMBSTONE)
+		{
+			if (__atomic_compare_exchange_n(&slot->ptr, &seen, ptr,
+					0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			{
+				/* The slots we passed may have been emptied since. Now that
+				 * we hold this one, a slot before it can only be emptied
+				 * after the one following it, so check them backwards. */
+				for (unsigned j = i; j-- > 0; )
+				{
+					void *before = __atomic_load_n(&table[(h + j) & (CALLSITE_CHUNK_SLOTS - 1)].ptr,
+						__ATOMIC_SEQ_CST);
+					if (before == CHUNK_SLOT_EMPTY || before == CHUNK_SLOT_LOCKED)
+					{
+						__atomic_store_n(&slot->ptr, CHUNK_SLOT_TOMBSTONE, __ATOMIC_SEQ_CST);
+						chunk_clear(table, (h + i) & (CALLSITE_CHUNK_SLOTS - 1));
+						goto restart;
+					}
+				}
+				/* No-one looks this chunk up until we have returned it. */
+				__atomic_store_n(&slot->site_and_size, site_and_size, __ATOMIC_RELEASE);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Returns the removed entry, or 0 if the chunk was not tracked. */
+static uint64_t chunk_remove(void *ptr)
+{
+	struct chunk_slot *table = __atomic_load_n(&chunks, __ATOMIC_ACQUIRE);
+	if (!table) return 0;
+	uint64_t h = hash_ptr(ptr);
+	for (unsigned i = 0; i < CALLSITE_MAX_PROBES; ++i)
+	{
+		size_t pos = (h + i) & (CALLSITE_CHUNK_SLOTS - 1);
+		struct chunk_slot *slot = &table[pos];
+		void *seen = __atomic_load_n(&slot->ptr, __ATOMIC_ACQUIRE);
+		if (seen == CHUNK_SLOT_EMPTY || seen == CHUNK_SLOT_LOCKED) return 0;
+		if (seen == ptr)
+		{
+			uint64_t site_and_size = __atomic_load_n(&slot->site_and_size, __ATOMIC_ACQUIRE);
+			__atomic_store_n(&slot->ptr, CHUNK_SLOT_TOMBSTONE, __ATOMIC_SEQ_CST);
+			chunk_clear(table, pos);
+			return site_and_size;
+		}
+	}
+	return 0;
+}
+
+static void track(void *ptr, size_t size, const void *caller)
+{
+	struct callsite_stats *s = site_lookup(callsite_shard(), caller, 1);
+	__atomic_add_fetch(&s->total_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->total_bytes, size, __ATOMIC_RELAXED);
+	/* Site indices start at 1, so that an entry is never 0. */
+	uint64_t site_and_size = ((uint64_t) size << CHUNK_SITE_BITS) | (uint64_t) (s - sites + 1);
+	if (!chunk_insert(ptr, site_and_size))
+	{
+		__atomic_add_fetch(&untracked, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_add_fetch(&s->live_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->live_bytes, (long) size, __ATOMIC_RELAXED);
+}
+
+static void release(uint64_t site_and_size)
+{
+	if (!site_and_size) return;
+	struct callsite_stats *s = &sites[(site_and_size & ((1ull << CHUNK_SITE_BITS) - 1)) - 1];
+	__atomic_sub_fetch(&s->live_count, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&s->live_bytes, (long) (site_and_size >> CHUNK_SITE_BITS), __ATOMIC_RELAXED);
+}
+
+void OUR_HOOK(init)(void)
+{
+	NEXT_HOOK(init)();
+}
+
+void *OUR_HOOK(malloc)(size_t size, const void *caller)
+{
+	void *ret = NEXT_HOOK(malloc)(size, caller);
+	if (ret) track(ret, size, caller);
+	return ret;
+}
+
+void *OUR_HOOK(calloc)(size_t nmemb, size_t size, const void *caller)
+{
+	void *ret = NEXT_HOOK(calloc)(nmemb, size, caller);
+	if (ret) track(ret, nmemb * size, caller);
+	return ret;
+}
+
+/* Untrack before freeing: afterwards, another thread may get the chunk. */
+void OUR_HOOK(free)(void *ptr, const void *caller)
+{
+	if (ptr) release(chunk_remove(ptr));
+	NEXT_HOOK(free)(ptr, caller);
+}
+
+void OUR_HOOK(free_sized)(void *ptr, size_t size, const void *caller)
+{
+	if (ptr) release(chunk_remove(ptr));
+	NEXT_HOOK(free_sized)(ptr, size, caller);
+}
+
+/* A moving or resizing realloc is charged to the realloc's call site. */
+void *OUR_HOOK(realloc)(void *ptr, size_t size, const void *caller)
+{
+	uint64_t old = ptr ? chunk_remove(ptr) : 0;
+	void *ret = NEXT_HOOK(realloc)(ptr, size, caller);
+	if (ret)
+	{
+		release(old);
+		track(ret, size, caller);
+	}
+	else if (ptr && size != 0)
+	{
+		/* It failed, so the old chunk is still live. */
+		if (old && !chunk_insert(ptr, old))
+		{
+			release(old);
+			__atomic_add_fetch(&untracked, 1, __ATOMIC_RELAXED);
+		}
+	}
+	else release(old);
+	return ret;
+}
+
+void **OUR_HOOK(malloc_batch)(size_t n, const size_t *sizes, void **out, const void *caller)
+{
+	void **ret = NEXT_HOOK(malloc_batch)(n, sizes, out, caller);
+	if (ret) for (size_t i = 0; i < n; ++i) track(out[i], sizes[i], caller);
+	return ret;
+}
+
+void OUR_HOOK(free_batch)(void *const *ptrs, size_t n, const void *caller)
+{
+	for (size_t i = 0; i < n; ++i) if (ptrs[i]) release(chunk_remove(ptrs[i]));
+	NEXT_HOOK(free_batch)(ptrs, n, caller);
+}
+
+/* Charged like a realloc, if it succeeds; if not, nothing changed. */
+void *OUR_HOOK(realloc_in_place)(void *ptr, size_t size, const void *caller)
+{
+	void *ret = NEXT_HOOK(realloc_in_place)(ptr, size, caller);
+	if (ret)
+	{
+		release(chunk_remove(ptr));
+		track(ret, size, caller);
+	}
+	return ret;
+}
+
+void *OUR_HOOK(memalign)(size_t alignment, size_t size, const void *caller)
+{
+	void *ret = NEXT_HOOK(memalign)(alignment, size, caller);
+	if (ret) track(ret, size, caller);
+	return ret;
+}
+
+size_t OUR_HOOK(malloc_usable_size)(void *ptr)
+{
+	return NEXT_HOOK(malloc_usable_size)(ptr);
+}
+
+size_t OUR_HOOK(good_size)(size_t size, size_t alignment, const void *caller)
+{
+	return NEXT_HOOK(good_size)(size, alignment, caller);
+}
+
+void callsite_profile_foreach(void (*cb)(const struct callsite_stats *s, void *arg), void *arg)
+{
+	struct callsite_stats catchall = { .caller = NULL };
+	for (unsigned shard = 0; shard < CALLSITE_SHARDS; ++shard)
+	{
+		for (unsigned i = 0; i < CALLSITE_SLOTS_PER_SHARD; ++i)
+		{
+			const void *caller = __atomic_load_n(&sites[shard * CALLSITE_SLOTS_PER_SHARD + i].caller,
+				__ATOMIC_ACQUIRE);
+			if (!caller) continue;
+			/* Only the first shard holding a site reports it, summing over the rest. */
+			_Bool seen_earlier = 0;
+			for (unsigned earlier = 0; earlier < shard && !seen_earlier; ++earlier)
+			{
+				seen_earlier = !!site_lookup(earlier, caller, 0);
+			}
+			if (seen_earlier) continue;
+			struct callsite_stats sum = { .caller = caller };
+			for (unsigned later = shard; later < CALLSITE_SHARDS; ++later)
+			{
+				struct callsite_stats *s = site_lookup(later, caller, 0);
+				if (!s) continue;
+				sum.live_bytes += __atomic_load_n(&s->live_bytes, __ATOMIC_RELAXED);
+				sum.live_count += __atomic_load_n(&s->live_count, __ATOMIC_RELAXED);
+				sum.total_allocs += __atomic_load_n(&s->total_allocs, __ATOMIC_RELAXED);
+				sum.total_bytes += __atomic_load_n(&s->total_bytes, __ATOMIC_RELAXED);
+			}
+			cb(&sum, arg);
+		}
+		struct callsite_stats *s = CALLSITE_CATCHALL(shard);
+		catchall.live_bytes += __atomic_load_n(&s->live_bytes, __ATOMIC_RELAXED);
+		catchall.live_count += __atomic_load_n(&s->live_count, __ATOMIC_RELAXED);
+		catchall.total_allocs += __atomic_load_n(&s->total_allocs, __ATOMIC_RELAXED);
+		catchall.total_bytes += __atomic_load_n(&s->total_bytes, __ATOMIC_RELAXED);
+	}
+	if (catchall.total_allocs) cb(&catchall, arg);
+}
+
+/* Without snprintf, which may allocate. */
+static char *put_str(char *pos, const char *str)
+{
+	while (*str) *pos++ = *str++;
+	return pos;
+}
+static char *put_unsigned(char *pos, unsigned long n, unsigned base)
+{
+	char digits[24];
+	unsigned len = 0;
+	do { digits[len++] = "0123456789abcdef"[n % base]; n /= base; } while (n);
+	while (len) *pos++ = digits[--len];
+	return pos;
+}
+static char *put_signed(char *pos, long n)
+{
+	if (n < 0) { *pos++ = '-'; return put_unsigned(pos, -(unsigned long) n, 10); }
+	return put_unsigned(pos, n, 10);
+}
+
+static void dump_one(const struct callsite_stats *s, void *arg)
+{
+	char buf[160];
+	char *pos = put_unsigned(put_str(buf, "0x"), (uintptr_t) s->caller, 16);
+	pos = put_signed(put_str(pos, "\t"), s->live_bytes);
+	pos = put_signed(put_str(pos, "\t"), s->live_count);
+	pos = put_unsigned(put_str(pos, "\t"), s->total_allocs, 10);
+	pos = put_unsigned(put_str(pos, "\t"), s->total_bytes, 10);
+	pos = put_str(pos, "\n");
+	write(*(int *) arg, buf, pos - buf);
+}
+
+void callsite_profile_dump(int fd)
+{
+	char buf[80];
+	char *pos = put_str(buf, "caller\tlive_bytes\tlive_count\ttotal_allocs\ttotal_bytes\n");
+	write(fd, buf, pos - buf);
+	callsite_profile_foreach(dump_one, &fd);
+	pos = put_unsigned(put_str(buf, "untracked\t"), __atomic_load_n(&untracked, __ATOMIC_RELAXED), 10);
+	pos = put_str(pos, "\n");
+	write(fd, buf, pos - buf);
+}
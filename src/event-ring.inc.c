@@ -0,0 +1,318 @@
+/* Asynchronous event transport for hook2event.c, which includes us
+ * when ALLOC_EVENT_TRANSPORT_RING is defined.
+ *
+ * The post_* events are not run on the allocating thread. Instead we
+ * write a fixed-size record into a per-thread single-producer, single-
+ * consumer ring, and a background thread drains every ring into the
+ * includer's real handlers. The pre_* events stay synchronous, because
+ * they can modify the allocation (pre_alloc), cancel it (pre_nonnull_free)
+ * or want to look at the chunk before it changes (pre_..._realloc).
+ *
+ * Things a deferred handler must live with:
+ * - by the time it runs, a freed chunk may already have been reused;
+ * - events from one thread arrive in order, but there is no ordering
+ *   between threads (a free on one thread may be delivered after the
+ *   malloc, on another, that reused its chunk);
+ * - it runs on the consumer thread; allocations made there are
+ *   delivered synchronously, so it may call malloc.
+ *
+ * When a ring is full we either drop the record and count it (default)
+ * or, if EVENT_RING_BLOCK is defined, wait for the consumer to catch up.
+ * Nothing here calls malloc, except pthread_create and pthread_setspecific
+ * on first use, during which this thread's events are delivered directly.
+ *
+ * When all rings are empty the consumer sleeps for longer and longer, up
+ * to EVENT_RING_IDLE_MAX_NS; a producer that finds its ring half full
+ * wakes it early. A forked child has no consumer thread, and its rings'
+ * owners are gone but for one, so it abandons them all; the next event
+ * starts a consumer, which delivers whatever the parent had left. */
+
+#include <stdint.h>
+#include <sched.h>    /* for sched_yield */
+#include <time.h>     /* for nanosleep */
+#include <pthread.h>
+#include <unistd.h>   /* for syscall */
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+
+#ifndef EVENT_RING_RECORDS
+#define EVENT_RING_RECORDS 4096 /* per thread; must be a power of two */
+#endif
+#ifndef EVENT_RING_IDLE_NS
+#define EVENT_RING_IDLE_NS 1000000 /* consumer's first sleep when all rings are empty */
+#endif
+#ifndef EVENT_RING_IDLE_MAX_NS
+#define EVENT_RING_IDLE_MAX_NS 128000000 /* ... doubling up to this; bounds flush latency */
+#endif
+
+enum event_kind
+{
+	EVENT_POST_SUCCESSFUL_ALLOC = 1,
+	EVENT_POST_NONNULL_FREE,
+	EVENT_POST_NONNULL_NONZERO_REALLOC,
+	EVENT_POST_REALLOC_IN_PLACE
+};
+/* One cache line. The meaning of 'sizes' depends on the kind. */
+struct event_record
+{
+	uintptr_t kind;
+	void *ptr;
+	void *new_ptr;
+	size_t sizes[4];
+	const void *caller;
+};
+
+enum ring_state { RING_OWNED = 1, RING_ABANDONED };
+struct event_ring
+{
+	/* Written only by the producer... */
+	_Alignas(64) unsigned long head;
+	unsigned long dropped;
+	/* ... and only by the consumer. */
+	_Alignas(64) unsigned long tail;
+	/* Rings are never unmapped; an exiting thread abandons its ring,
+	 * and the next new thread takes it over. */
+	_Alignas(64) struct event_ring *next;
+	int state;
+	struct event_record records[EVENT_RING_RECORDS];
+};
+
+enum consumer_state { CONSUMER_NONE, CONSUMER_STARTING, CONSUMER_RUNNING, CONSUMER_FAILED };
+static int consumer_state;
+static struct event_ring *rings;
+static pthread_key_t ring_key;
+static _Bool ring_key_created; /* and fork handler registered; a child inherits both */
+static int consumer_parked; /* futex word: nonzero while the consumer sleeps */
+
+/* All initial-exec, for the same reason as in terminal-indirect-dlsym.c. */
+static __thread struct event_ring *my_ring __attribute__((tls_model("initial-exec")));
+static __thread _Bool ring_attaching __attribute__((tls_model("initial-exec")));
+static __thread _Bool ring_detached __attribute__((tls_model("initial-exec")));
+static __thread _Bool ring_is_consumer __attribute__((tls_model("initial-exec")));
+
+static void ring_deliver(const struct event_record *r)
+{
+	switch (r->kind)
+	{
+#ifdef HAVE_ALLOC_EVENT_post_successful_alloc
+		case EVENT_POST_SUCCESSFUL_ALLOC:
+			ALLOC_EVENT(post_successful_alloc)(r->ptr, r->sizes[0], r->sizes[1],
+				r->sizes[2], r->sizes[3], r->caller);
+			break;
+#endif
+#ifdef HAVE_ALLOC_EVENT_post_nonnull_free
+		case EVENT_POST_NONNULL_FREE:
+			ALLOC_EVENT(post_nonnull_free)(r->ptr);
+			break;
+#endif
+#ifdef HAVE_ALLOC_EVENT_post_nonnull_nonzero_realloc
+		case EVENT_POST_NONNULL_NONZERO_REALLOC:
+			ALLOC_EVENT(post_nonnull_nonzero_realloc)(r->ptr, r->sizes[0], r->sizes[1],
+				r->caller, r->new_ptr);
+			break;
+#endif
+#ifdef HAVE_ALLOC_EVENT_post_realloc_in_place
+		case EVENT_POST_REALLOC_IN_PLACE:
+			ALLOC_EVENT(post_realloc_in_place)(r->ptr, r->sizes[0], r->sizes[1], r->caller);
+			break;
+#endif
+		default:
+			break;
+	}
+}
+
+static _Bool ring_drain(struct event_ring *ring)
+{
+	unsigned long tail = ring->tail;
+	unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (tail == head) return 0;
+	for (; tail != head; ++tail)
+	{
+		ring_deliver(&ring->records[tail & (EVENT_RING_RECORDS - 1)]);
+	}
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static void *ring_consumer(void *arg)
+{
+	ring_is_consumer = 1;
+	unsigned long idle_ns = EVENT_RING_IDLE_NS;
+	for (;;)
+	{
+		_Bool drained_any = 0;
+		for (struct event_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+				ring; ring = ring->next)
+		{
+			drained_any |= ring_drain(ring);
+		}
+		if (drained_any) { idle_ns = EVENT_RING_IDLE_NS; continue; }
+		const struct timespec idle = { idle_ns / 1000000000, idle_ns % 1000000000 };
+		__atomic_store_n(&consumer_parked, 1, __ATOMIC_SEQ_CST);
+		/* Returns at once if a producer has already cleared it. */
+		if (0 != syscall(SYS_futex, &consumer_parked, FUTEX_WAIT_PRIVATE, 1, &idle, NULL, 0)
+				&& errno == ENOSYS) nanosleep(&idle, NULL);
+		__atomic_store_n(&consumer_parked, 0, __ATOMIC_RELAXED);
+		idle_ns = (idle_ns * 2 > EVENT_RING_IDLE_MAX_NS) ? EVENT_RING_IDLE_MAX_NS : idle_ns * 2;
+	}
+	return NULL;
+}
+
+static void ring_wake_consumer(void)
+{
+	if (__atomic_exchange_n(&consumer_parked, 0, __ATOMIC_SEQ_CST))
+	{
+		syscall(SYS_futex, &consumer_parked, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+static void ring_detach(void *arg)
+{
+	struct event_ring *ring = arg;
+	/* Anything this thread does from now on is delivered directly. */
+	my_ring = NULL;
+	ring_detached = 1;
+	__atomic_store_n(&ring->state, RING_ABANDONED, __ATOMIC_RELEASE);
+}
+
+/* We are the forking thread, alone in the child. Its ring and everyone
+ * else's stay in the list, to be drained; ours is attached afresh. */
+static void ring_fork_child(void)
+{
+	for (struct event_ring *ring = rings; ring; ring = ring->next)
+	{
+		ring->state = RING_ABANDONED;
+	}
+	my_ring = NULL;
+	ring_is_consumer = 0;
+	consumer_parked = 0;
+	consumer_state = CONSUMER_NONE;
+}
+
+static _Bool ring_start_consumer(void)
+{
+	int state = CONSUMER_NONE;
+	if (__atomic_compare_exchange_n(&consumer_state, &state, CONSUMER_STARTING,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		pthread_t consumer;
+		if (!ring_key_created)
+		{
+			ring_key_created = (0 == pthread_key_create(&ring_key, ring_detach))
+				&& (0 == pthread_atfork(NULL, NULL, ring_fork_child));
+		}
+		int ok = ring_key_created
+			&& (0 == pthread_create(&consumer, NULL, ring_consumer, NULL));
+		if (ok) pthread_detach(consumer);
+		state = ok ? CONSUMER_RUNNING : CONSUMER_FAILED;
+		__atomic_store_n(&consumer_state, state, __ATOMIC_RELEASE);
+	}
+	while (state == CONSUMER_STARTING)
+	{
+		sched_yield();
+		state = __atomic_load_n(&consumer_state, __ATOMIC_ACQUIRE);
+	}
+	return state == CONSUMER_RUNNING;
+}
+
+static struct event_ring *ring_attach(void)
+{
+	struct event_ring *ring;
+	if (ring_attaching || ring_detached || ring_is_consumer) return NULL;
+	ring_attaching = 1;
+	if (!ring_start_consumer()) { ring = NULL; goto out; }
+	for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+	{
+		int state = RING_ABANDONED;
+		if (__atomic_compare_exchange_n(&ring->state, &state, RING_OWNED,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) goto got;
+	}
+	ring = mmap(NULL, sizeof (struct event_ring), PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED) { ring = NULL; goto out; }
+	ring->state = RING_OWNED;
+	ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &ring->next, ring,
+			1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+got:
+	my_ring = ring;
+	pthread_setspecific(ring_key, ring);
+out:
+	ring_attaching = 0;
+	return ring;
+}
+
+static inline void ring_put(const struct event_record *r)
+{
+	struct event_ring *ring = my_ring;
+	if (__builtin_expect(!ring, 0)) ring = ring_attach();
+	if (!ring) { ring_deliver(r); return; }
+	unsigned long head = ring->head;
+	unsigned long tail;
+	while (head - (tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) == EVENT_RING_RECORDS)
+	{
+#ifdef EVENT_RING_BLOCK
+		sched_yield();
+#else
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+#endif
+	}
+	ring->records[head & (EVENT_RING_RECORDS - 1)] = *r;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	if (__builtin_expect(head + 1 - tail >= EVENT_RING_RECORDS / 2, 0)
+			&& __atomic_load_n(&consumer_parked, __ATOMIC_RELAXED)) ring_wake_consumer();
+}
+
+/* Now divert the deferrable events into the ring. */
+#ifdef HAVE_ALLOC_EVENT_post_successful_alloc
+#undef DISPATCH_post_successful_alloc
+#define DISPATCH_post_successful_alloc(p, msize, malign, rsize, ralign, c) \
+	ring_put(&(struct event_record) { .kind = EVENT_POST_SUCCESSFUL_ALLOC, \
+		.ptr = (p), .sizes = { (msize), (malign), (rsize), (ralign) }, .caller = (c) })
+#endif
+#ifdef HAVE_ALLOC_EVENT_post_nonnull_free
+#undef DISPATCH_post_nonnull_free
+#define DISPATCH_post_nonnull_free(p) \
+	ring_put(&(struct event_record) { .kind = EVENT_POST_NONNULL_FREE, .ptr = (p) })
+#endif
+#ifdef HAVE_ALLOC_EVENT_post_nonnull_nonzero_realloc
+#undef DISPATCH_post_nonnull_nonzero_realloc
+#define DISPATCH_post_nonnull_nonzero_realloc(p, msize, old_usize, c, newp) \
+	ring_put(&(struct event_record) { .kind = EVENT_POST_NONNULL_NONZERO_REALLOC, \
+		.ptr = (p), .new_ptr = (newp), .sizes = { (msize), (old_usize) }, .caller = (c) })
+#endif
+#ifdef HAVE_ALLOC_EVENT_post_realloc_in_place
+#undef DISPATCH_post_realloc_in_place
+#define DISPATCH_post_realloc_in_place(p, msize, old_usize, c) \
+	ring_put(&(struct event_record) { .kind = EVENT_POST_REALLOC_IN_PLACE, \
+		.ptr = (p), .sizes = { (msize), (old_usize) }, .caller = (c) })
+#endif
+
+HIDDEN
+size_t alloc_event_ring_dropped(void)
+{
+	size_t total = 0;
+	for (struct event_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+			ring; ring = ring->next)
+	{
+		total += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	}
+	return total;
+}
+
+HIDDEN
+void alloc_event_ring_flush(void)
+{
+	if (ring_is_consumer) return;
+	for (struct event_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+			ring; ring = ring->next)
+	{
+		unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		while ((long) (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) > 0)
+		{
+			sched_yield();
+		}
+	}
+}
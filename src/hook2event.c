@@ -1,4 +1,7 @@
 #include <strings.h>  /* for bzero */
+#include <string.h>   /* for memcpy */
+#include <stddef.h>   /* for max_align_t */
+#include <stdint.h>
 #include <errno.h>    /* for EINVAL */
 #include <stdio.h>    /* for stderr */
 #include <assert.h>
@@ -24,6 +27,13 @@
 #define HOOK_PREFIX(m) NEXT_HOOK(m)
 #endif
 #include "mallochooks/hookapi.h"
+/* Also declare the hooks we define, so that they get the same (hidden)
+ * attributes; otherwise they are interposable and cannot be inlined. */
+#pragma push_macro("HOOK_PREFIX")
+#undef HOOK_PREFIX
+#define HOOK_PREFIX(m) OUR_HOOK(m)
+#include "mallochooks/hookapi.h"
+#pragma pop_macro("HOOK_PREFIX")
 
 /* By default, event handler function definitions are hidden */
 #define HIDDEN __attribute__((visibility("hidden")))
@@ -32,6 +42,111 @@
 #endif
 #include "mallochooks/eventapi.h"
 
+/* Which events does our includer handle? By default, all of them. An
+ * includer that defines ALLOC_EVENTS_EXPLICIT instead says which ones
+ * it has, by defining HAVE_ALLOC_EVENT_<name> for each, and the calls to
+ * the others compile away (as do any malloc_usable_size queries that
+ * only those events need). rules.mk does this from MALLOCHOOKS_EVENTS. */
+#ifndef ALLOC_EVENTS_EXPLICIT
+#define HAVE_ALLOC_EVENT_post_init
+#define HAVE_ALLOC_EVENT_pre_alloc
+#define HAVE_ALLOC_EVENT_post_successful_alloc
+#define HAVE_ALLOC_EVENT_pre_nonnull_free
+#define HAVE_ALLOC_EVENT_post_nonnull_free
+#define HAVE_ALLOC_EVENT_pre_nonnull_nonzero_realloc
+#define HAVE_ALLOC_EVENT_post_nonnull_nonzero_realloc
+#endif
+
+/* Unless told otherwise, we assume a pre_alloc may grow chunks (e.g. to
+ * add a trailer), so that a chunk's size is not what its caller asked
+ * for. An includer whose pre_alloc never changes the size can say so by
+ * defining PRE_ALLOC_PRESERVES_SIZE; with no pre_alloc, it goes without
+ * saying. */
+#if !defined(HAVE_ALLOC_EVENT_pre_alloc) && !defined(PRE_ALLOC_PRESERVES_SIZE)
+#define PRE_ALLOC_PRESERVES_SIZE
+#endif
+
+#ifdef HAVE_ALLOC_EVENT_post_init
+#define DISPATCH_post_init(...) ALLOC_EVENT(post_init)(__VA_ARGS__)
+#else
+#define DISPATCH_post_init(...) ((void)0)
+#endif
+#ifdef HAVE_ALLOC_EVENT_pre_alloc
+#define DISPATCH_pre_alloc(...) ALLOC_EVENT(pre_alloc)(__VA_ARGS__)
+#else
+#define DISPATCH_pre_alloc(...) ((void)0)
+#endif
+#ifdef HAVE_ALLOC_EVENT_post_successful_alloc
+#define DISPATCH_post_successful_alloc(...) ALLOC_EVENT(post_successful_alloc)(__VA_ARGS__)
+#else
+#define DISPATCH_post_successful_alloc(...) ((void)0)
+#endif
+#ifdef HAVE_ALLOC_EVENT_pre_nonnull_free
+#define DISPATCH_pre_nonnull_free(...) ALLOC_EVENT(pre_nonnull_free)(__VA_ARGS__)
+#else
+#define DISPATCH_pre_nonnull_free(...) (0)
+#endif
+#ifdef HAVE_ALLOC_EVENT_post_nonnull_free
+#define DISPATCH_post_nonnull_free(...) ALLOC_EVENT(post_nonnull_free)(__VA_ARGS__)
+#else
+#define DISPATCH_post_nonnull_free(...) ((void)0)
+#endif
+#ifdef HAVE_ALLOC_EVENT_pre_nonnull_nonzero_realloc
+#define DISPATCH_pre_nonnull_nonzero_realloc(...) ALLOC_EVENT(pre_nonnull_nonzero_realloc)(__VA_ARGS__)
+#else
+#define DISPATCH_pre_nonnull_nonzero_realloc(...) ((void)0)
+#endif
+#ifdef HAVE_ALLOC_EVENT_post_nonnull_nonzero_realloc
+#define DISPATCH_post_nonnull_nonzero_realloc(...) ALLOC_EVENT(post_nonnull_nonzero_realloc)(__VA_ARGS__)
+#else
+#define DISPATCH_post_nonnull_nonzero_realloc(...) ((void)0)
+#endif
+/* Not among the defaults above: see eventapi.h. */
+#ifdef HAVE_ALLOC_EVENT_post_realloc_in_place
+#define DISPATCH_post_realloc_in_place(...) ALLOC_EVENT(post_realloc_in_place)(__VA_ARGS__)
+#else
+#define DISPATCH_post_realloc_in_place(...) ((void)0)
+#endif
+#ifdef HAVE_ALLOC_EVENT_post_successful_alloc_batch
+#define DISPATCH_post_successful_alloc_batch(...) ALLOC_EVENT(post_successful_alloc_batch)(__VA_ARGS__)
+#else
+#define DISPATCH_post_successful_alloc_batch(...) ((void)0)
+#endif
+#ifdef HAVE_ALLOC_EVENT_post_nonnull_free_batch
+#define DISPATCH_post_nonnull_free_batch(...) ALLOC_EVENT(post_nonnull_free_batch)(__VA_ARGS__)
+#else
+#define DISPATCH_post_nonnull_free_batch(...) ((void)0)
+#endif
+
+/* Only the free and realloc events want the old chunk's usable size. */
+#ifdef HAVE_ALLOC_EVENT_pre_nonnull_free
+#define NEED_FREED_USABLE_SIZE
+#endif
+#if defined(HAVE_ALLOC_EVENT_pre_nonnull_free) || defined(HAVE_ALLOC_EVENT_post_nonnull_nonzero_realloc)
+#define NEED_REALLOC_USABLE_SIZE
+#endif
+#if defined(HAVE_ALLOC_EVENT_post_realloc_in_place) || defined(HAVE_ALLOC_EVENT_post_nonnull_nonzero_realloc)
+#define NEED_IN_PLACE_USABLE_SIZE
+#endif
+
+/* Optionally, report only a Poisson sample of chunks. Every chunk
+ * is considered sampled otherwise, and this all compiles away. */
+#ifdef ALLOC_EVENT_SAMPLE_BYTES
+#include "sampling.inc.c"
+#else
+#define SAMPLE_ALLOC(size) 1
+#define SAMPLE_REMEMBER(userptr) 1
+#define SAMPLE_FORGET(userptr) 1
+#endif
+
+/* Optionally, run the post_* events on a background thread. */
+#ifdef ALLOC_EVENT_TRANSPORT_RING
+#if defined(HAVE_ALLOC_EVENT_post_successful_alloc_batch) || defined(HAVE_ALLOC_EVENT_post_nonnull_free_batch)
+#error "the batch events carry arrays, so cannot go through the event ring"
+#endif
+#include "event-ring.inc.c"
+#endif
+
 /* We can translate between 'alloc' and 'user' pointers,
  * if instrumentation is adding a header. However, in
  * practice trailers are more robust. */
@@ -47,10 +162,32 @@
 #warning "alloc <-> user translation is not robust"
 #endif
 
+/* Chunks from malloc, calloc and realloc are already this aligned, so
+ * only a pre_alloc that asks for more alignment (say, a cache line of the
+ * chunk's own) sends them to memalign. */
+#ifndef MALLOC_NATURAL_ALIGNMENT
+#define MALLOC_NATURAL_ALIGNMENT _Alignof (max_align_t)
+#endif
+#define NEEDS_MEMALIGN(alignment) ((alignment) > MALLOC_NATURAL_ALIGNMENT)
+
+/* realloc, when it must give more alignment than the next realloc does:
+ * keep the chunk if it is aligned and big enough, else move it. */
+static void *realloc_aligned(void *allocptr, size_t alignment, size_t size, const void *caller)
+{
+	if (!allocptr) return NEXT_HOOK(memalign)(alignment, size, caller);
+	size_t old_size = NEXT_HOOK(malloc_usable_size)(allocptr);
+	if ((uintptr_t) allocptr % alignment == 0 && old_size >= size) return allocptr;
+	void *new_allocptr = NEXT_HOOK(memalign)(alignment, size, caller);
+	if (!new_allocptr) return NULL;
+	memcpy(new_allocptr, allocptr, old_size < size ? old_size : size);
+	NEXT_HOOK(free)(allocptr, caller);
+	return new_allocptr;
+}
+
 void OUR_HOOK(init)(void)
 {
 	// chain here
-	ALLOC_EVENT(post_init)();
+	DISPATCH_post_init();
 	NEXT_HOOK(init)();
 }
 
@@ -60,14 +197,17 @@ void *OUR_HOOK(malloc)(size_t size, const void *caller)
 	#ifdef TRACE_MALLOC_HOOKS
 	fprintf(stderr, "called malloc(%zu)\n", size);
 	#endif
+	_Bool sampled = SAMPLE_ALLOC(size);
 	size_t modified_size = size;
 	size_t modified_alignment = sizeof (void *);
-	ALLOC_EVENT(pre_alloc)(&modified_size, &modified_alignment, caller);
-	assert(modified_alignment == sizeof (void *));
+	DISPATCH_pre_alloc(&modified_size, &modified_alignment, caller);
 	
-	result = NEXT_HOOK(malloc)(modified_size, caller);
+	if (NEEDS_MEMALIGN(modified_alignment))
+		result = NEXT_HOOK(memalign)(modified_alignment, modified_size, caller);
+	else result = NEXT_HOOK(malloc)(modified_size, caller);
 	
-	if (result) ALLOC_EVENT(post_successful_alloc)(result, modified_size, modified_alignment, 
+	if (result && sampled && SAMPLE_REMEMBER(ALLOCPTR_TO_USERPTR(result)))
+		DISPATCH_post_successful_alloc(result, modified_size, modified_alignment, 
 			size, sizeof (void*), caller);
 	#ifdef TRACE_MALLOC_HOOKS
 	fprintf(stderr, "malloc(%zu) returned chunk at %p (modified size: %zu, userptr: %p)\n", 
@@ -76,29 +216,107 @@ void *OUR_HOOK(malloc)(size_t size, const void *caller)
 	return ALLOCPTR_TO_USERPTR(result);
 }
 
+void *OUR_HOOK(calloc)(size_t nmemb, size_t size, const void *caller)
+{
+	void *result;
+	size_t total;
+	#ifdef TRACE_MALLOC_HOOKS
+	fprintf(stderr, "called calloc(%zu, %zu)\n", nmemb, size);
+	#endif
+	if (__builtin_mul_overflow(nmemb, size, &total))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	_Bool sampled = SAMPLE_ALLOC(total);
+	size_t modified_size = total;
+	size_t modified_alignment = sizeof (void *);
+	DISPATCH_pre_alloc(&modified_size, &modified_alignment, caller);
+
+	/* Let the next layer do the zeroing, so that an allocator which
+	 * knows its memory is already clean (fresh mmap pages, say) can
+	 * skip it. If the size was modified, the extra (e.g. a trailer)
+	 * gets zeroed too, which is harmless. There is no aligned calloc,
+	 * though, so then we zero it ourselves. */
+	if (NEEDS_MEMALIGN(modified_alignment))
+	{
+		result = NEXT_HOOK(memalign)(modified_alignment, modified_size, caller);
+		if (result) bzero(result, modified_size);
+	}
+	else if (modified_size == total) result = NEXT_HOOK(calloc)(nmemb, size, caller);
+	else result = NEXT_HOOK(calloc)(1, modified_size, caller);
+
+	if (result && sampled && SAMPLE_REMEMBER(ALLOCPTR_TO_USERPTR(result)))
+		DISPATCH_post_successful_alloc(result, modified_size, modified_alignment,
+			total, sizeof (void*), caller);
+	#ifdef TRACE_MALLOC_HOOKS
+	fprintf(stderr, "calloc(%zu, %zu) returned chunk at %p (modified size: %zu, userptr: %p)\n",
+		nmemb, size, result, modified_size, ALLOCPTR_TO_USERPTR(result));
+	#endif
+	return ALLOCPTR_TO_USERPTR(result);
+}
+
 void OUR_HOOK(free)(void *userptr, const void *caller)
 {
 	void *allocptr = USERPTR_TO_ALLOCPTR(userptr);
 	#ifdef TRACE_MALLOC_HOOKS
 	if (userptr != NULL) fprintf(stderr, "freeing chunk at %p (userptr %p)\n", allocptr, userptr);
 	#endif
+	/* Forget a sampled chunk *before* freeing it, since once it is
+	 * freed another thread may be given it and remember it afresh. */
+	_Bool report = userptr != NULL && SAMPLE_FORGET(userptr);
 	/* FIXME: which malloc_usable_size should we use here? */
-	if (userptr != NULL)
+#ifdef NEED_FREED_USABLE_SIZE
+	if (report)
 	{
 		size_t size = NEXT_HOOK(malloc_usable_size)(allocptr);
-		if (ALLOC_EVENT(pre_nonnull_free)(userptr, size))
+		if (DISPATCH_pre_nonnull_free(userptr, size))
 		{
 			/* the pre-hook can 'cancel' the free by returning nonzero */
+			(void) SAMPLE_REMEMBER(userptr);
 			return;
 		}
 	}
+#endif
 	
 	NEXT_HOOK(free)(allocptr, caller);
 	
-	if (userptr != NULL) ALLOC_EVENT(post_nonnull_free)(userptr);
+	if (report) DISPATCH_post_nonnull_free(userptr);
+	#ifdef TRACE_MALLOC_HOOKS
+	fprintf(stderr, "freed chunk at %p\n", allocptr);
+	#endif
+}
+
+/* A sized free lets us skip the usable-size query, but only if the
+ * caller's size is the chunk's: if pre_alloc may have grown it, we can
+ * neither report that size nor pass it on. */
+void OUR_HOOK(free_sized)(void *userptr, size_t size, const void *caller)
+{
+#ifndef PRE_ALLOC_PRESERVES_SIZE
+	OUR_HOOK(free)(userptr, caller);
+#else
+	void *allocptr = USERPTR_TO_ALLOCPTR(userptr);
+	#ifdef TRACE_MALLOC_HOOKS
+	if (userptr != NULL) fprintf(stderr, "freeing chunk at %p (userptr %p, size %zu)\n", allocptr, userptr, size);
+	#endif
+	_Bool report = userptr != NULL && SAMPLE_FORGET(userptr);
+	if (report)
+	{
+		if (DISPATCH_pre_nonnull_free(userptr, size))
+		{
+			/* the pre-hook can 'cancel' the free by returning nonzero */
+			(void) SAMPLE_REMEMBER(userptr);
+			return;
+		}
+	}
+
+	NEXT_HOOK(free_sized)(allocptr, size, caller);
+
+	if (report) DISPATCH_post_nonnull_free(userptr);
 	#ifdef TRACE_MALLOC_HOOKS
 	fprintf(stderr, "freed chunk at %p\n", allocptr);
 	#endif
+#endif
 }
 
 void *OUR_HOOK(memalign)(size_t alignment, size_t size, const void *caller)
@@ -109,11 +327,13 @@ void *OUR_HOOK(memalign)(size_t alignment, size_t size, const void *caller)
 	#ifdef TRACE_MALLOC_HOOKS
 	fprintf(stderr, "calling memalign(%zu, %zu)\n", alignment, size);
 	#endif
-	ALLOC_EVENT(pre_alloc)(&modified_size, &modified_alignment, caller);
+	_Bool sampled = SAMPLE_ALLOC(size);
+	DISPATCH_pre_alloc(&modified_size, &modified_alignment, caller);
 	
 	result = NEXT_HOOK(memalign)(modified_alignment, modified_size, caller);
 	
-	if (result) ALLOC_EVENT(post_successful_alloc)(result, modified_size, modified_alignment, size, alignment, caller);
+	if (result && sampled && SAMPLE_REMEMBER(ALLOCPTR_TO_USERPTR(result)))
+		DISPATCH_post_successful_alloc(result, modified_size, modified_alignment, size, alignment, caller);
 	#ifdef TRACE_MALLOC_HOOKS
 	printf ("memalign(%zu, %zu) returned %p\n", alignment, size, result);
 	#endif
@@ -125,8 +345,12 @@ void *OUR_HOOK(realloc)(void *userptr, size_t size, const void *caller)
 {
 	void *result_allocptr;
 	void *allocptr = USERPTR_TO_ALLOCPTR(userptr);
-	size_t alignment = sizeof (void*);
-	size_t old_usable_size;
+	size_t alignment __attribute__((unused)) = sizeof (void*);
+	size_t old_usable_size __attribute__((unused)) = 0;
+	/* Do we report the old chunk going, or (if it was not sampled)
+	 * the new one arriving? */
+	_Bool report_old = 0;
+	_Bool sampled_new = 0;
 	#ifdef TRACE_MALLOC_HOOKS
 	fprintf(stderr, "realigning user pointer %p (allocptr: %p) to requested size %zu\n", userptr, 
 			allocptr, size);
@@ -136,14 +360,25 @@ void *OUR_HOOK(realloc)(void *userptr, size_t size, const void *caller)
 	if (userptr == NULL)
 	{
 		/* We behave like malloc(). */
-		ALLOC_EVENT(pre_alloc)(&size, &alignment, caller);
+		DISPATCH_pre_alloc(&size, &alignment, caller);
+		sampled_new = SAMPLE_ALLOC(size);
 	}
 	else if (size == 0)
 	{
 		/* We behave like free(). */
-		old_usable_size = NEXT_HOOK(malloc_usable_size)(allocptr);
-		/* The free hook can 'cancel' the free by returning non-zero. */
-		if (ALLOC_EVENT(pre_nonnull_free)(userptr, old_usable_size)) return NULL;
+		report_old = SAMPLE_FORGET(userptr);
+		if (report_old)
+		{
+#ifdef NEED_FREED_USABLE_SIZE
+			old_usable_size = NEXT_HOOK(malloc_usable_size)(allocptr);
+#endif
+			/* The free hook can 'cancel' the free by returning non-zero. */
+			if (DISPATCH_pre_nonnull_free(userptr, old_usable_size))
+			{
+				(void) SAMPLE_REMEMBER(userptr);
+				return NULL;
+			}
+		}
 	}
 	else
 	{
@@ -151,8 +386,15 @@ void *OUR_HOOK(realloc)(void *userptr, size_t size, const void *caller)
 		 * original block untouched. 
 		 * If it changes, we'll need to know the old usable size to access
 		 * the old trailer. */
-		old_usable_size = NEXT_HOOK(malloc_usable_size)(allocptr);
-		ALLOC_EVENT(pre_nonnull_nonzero_realloc)(userptr, size, caller);
+		report_old = SAMPLE_FORGET(userptr);
+		if (report_old)
+		{
+#ifdef NEED_REALLOC_USABLE_SIZE
+			old_usable_size = NEXT_HOOK(malloc_usable_size)(allocptr);
+#endif
+			DISPATCH_pre_nonnull_nonzero_realloc(userptr, size, caller);
+		}
+		else sampled_new = SAMPLE_ALLOC(size);
 	}
 	
 	/* Modify the size, as usual, *only if* size != 0 */
@@ -160,27 +402,37 @@ void *OUR_HOOK(realloc)(void *userptr, size_t size, const void *caller)
 	size_t modified_alignment = sizeof (void *);
 	if (size != 0)
 	{
-		ALLOC_EVENT(pre_alloc)(&modified_size, &modified_alignment, caller);
-		assert(modified_alignment == sizeof (void *));
+		DISPATCH_pre_alloc(&modified_size, &modified_alignment, caller);
 	}
 
-	result_allocptr = NEXT_HOOK(realloc)(allocptr, modified_size, caller);
+	if (NEEDS_MEMALIGN(modified_alignment))
+		result_allocptr = realloc_aligned(allocptr, modified_alignment, modified_size, caller);
+	else result_allocptr = NEXT_HOOK(realloc)(allocptr, modified_size, caller);
 	
 	if (userptr == NULL)
 	{
 		/* like malloc() */
-		if (result_allocptr) ALLOC_EVENT(post_successful_alloc)(result_allocptr, modified_size, modified_alignment, 
+		if (result_allocptr && sampled_new && SAMPLE_REMEMBER(ALLOCPTR_TO_USERPTR(result_allocptr)))
+			DISPATCH_post_successful_alloc(result_allocptr, modified_size, modified_alignment, 
 				size, sizeof (void*), caller);
 	}
 	else if (size == 0)
 	{
 		/* like free */
-		ALLOC_EVENT(post_nonnull_free)(userptr);
+		if (report_old) DISPATCH_post_nonnull_free(userptr);
+	}
+	else if (report_old)
+	{
+		/* bona fide realloc; if it failed, the old chunk is still live */
+		(void) SAMPLE_REMEMBER(result_allocptr ? ALLOCPTR_TO_USERPTR(result_allocptr) : userptr);
+		DISPATCH_post_nonnull_nonzero_realloc(userptr, modified_size, old_usable_size, caller, result_allocptr);
 	}
 	else
 	{
-		/* bona fide realloc */
-		ALLOC_EVENT(post_nonnull_nonzero_realloc)(userptr, modified_size, old_usable_size, caller, result_allocptr);
+		/* an unsampled chunk moved; maybe its new self is sampled */
+		if (result_allocptr && sampled_new && SAMPLE_REMEMBER(ALLOCPTR_TO_USERPTR(result_allocptr)))
+			DISPATCH_post_successful_alloc(result_allocptr, modified_size, modified_alignment,
+				size, sizeof (void*), caller);
 	}
 
 	#ifdef TRACE_MALLOC_HOOKS
@@ -190,7 +442,177 @@ void *OUR_HOOK(realloc)(void *userptr, size_t size, const void *caller)
 	return ALLOCPTR_TO_USERPTR(result_allocptr);
 }
 
+/* Like a bona fide realloc, except that the chunk never moves, and if it
+ * can't be resized, nothing happens at all. */
+void *OUR_HOOK(realloc_in_place)(void *userptr, size_t size, const void *caller)
+{
+	void *allocptr = USERPTR_TO_ALLOCPTR(userptr);
+	size_t old_usable_size __attribute__((unused)) = 0;
+	if (userptr == NULL) return NULL;
+	size_t modified_size = size;
+	size_t modified_alignment __attribute__((unused)) = sizeof (void *);
+	if (size != 0) DISPATCH_pre_alloc(&modified_size, &modified_alignment, caller);
+	_Bool report = SAMPLE_FORGET(userptr);
+#ifdef NEED_IN_PLACE_USABLE_SIZE
+	if (report) old_usable_size = NEXT_HOOK(malloc_usable_size)(allocptr);
+#endif
+#ifndef HAVE_ALLOC_EVENT_post_realloc_in_place
+	if (report) DISPATCH_pre_nonnull_nonzero_realloc(userptr, size, caller);
+#endif
+
+	void *result_allocptr = NEXT_HOOK(realloc_in_place)(allocptr, modified_size, caller);
+
+	if (report)
+	{
+		(void) SAMPLE_REMEMBER(userptr);
+#ifdef HAVE_ALLOC_EVENT_post_realloc_in_place
+		if (result_allocptr) DISPATCH_post_realloc_in_place(userptr, modified_size, old_usable_size, caller);
+#else
+		DISPATCH_post_nonnull_nonzero_realloc(userptr, modified_size, old_usable_size, caller,
+			result_allocptr);
+#endif
+	}
+	#ifdef TRACE_MALLOC_HOOKS
+	fprintf(stderr, "resized user chunk at %p in place to %zu: %s\n", userptr, size,
+		result_allocptr ? "done" : "failed");
+	#endif
+	return result_allocptr ? userptr : NULL;
+}
+
+/* Batches are handled in groups small enough for our arrays of the
+ * modified sizes etc. to live on the stack. Each group goes down as one
+ * batch, unless pre_alloc wants more alignment for one of its chunks. */
+#ifndef ALLOC_EVENT_BATCH_GROUP
+#define ALLOC_EVENT_BATCH_GROUP 64
+#endif
+static void **malloc_group(size_t n, const size_t *sizes, void **out, const void *caller)
+{
+	size_t modified_sizes[ALLOC_EVENT_BATCH_GROUP];
+	size_t modified_alignments[ALLOC_EVENT_BATCH_GROUP];
+	_Bool sampled[ALLOC_EVENT_BATCH_GROUP];
+	_Bool one_by_one = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		sampled[i] = SAMPLE_ALLOC(sizes[i]);
+		modified_sizes[i] = sizes[i];
+		modified_alignments[i] = sizeof (void *);
+		DISPATCH_pre_alloc(&modified_sizes[i], &modified_alignments[i], caller);
+		one_by_one |= NEEDS_MEMALIGN(modified_alignments[i]);
+	}
+	if (!one_by_one)
+	{
+		if (!NEXT_HOOK(malloc_batch)(n, modified_sizes, out, caller)) return NULL;
+	}
+	else for (size_t i = 0; i < n; ++i)
+	{
+		out[i] = NEEDS_MEMALIGN(modified_alignments[i])
+			? NEXT_HOOK(memalign)(modified_alignments[i], modified_sizes[i], caller)
+			: NEXT_HOOK(malloc)(modified_sizes[i], caller);
+		if (!out[i])
+		{
+			while (i > 0) NEXT_HOOK(free)(out[--i], caller);
+			return NULL;
+		}
+	}
+#ifdef HAVE_ALLOC_EVENT_post_successful_alloc_batch
+	void *reported[ALLOC_EVENT_BATCH_GROUP];
+	size_t reported_modified_sizes[ALLOC_EVENT_BATCH_GROUP];
+	size_t reported_sizes[ALLOC_EVENT_BATCH_GROUP];
+	size_t nreported = 0;
+#endif
+	for (size_t i = 0; i < n; ++i)
+	{
+		out[i] = ALLOCPTR_TO_USERPTR(out[i]);
+		if (!sampled[i] || !SAMPLE_REMEMBER(out[i])) continue;
+#ifdef HAVE_ALLOC_EVENT_post_successful_alloc_batch
+		reported[nreported] = out[i];
+		reported_modified_sizes[nreported] = modified_sizes[i];
+		reported_sizes[nreported++] = sizes[i];
+#else
+		DISPATCH_post_successful_alloc(out[i], modified_sizes[i], modified_alignments[i],
+			sizes[i], sizeof (void*), caller);
+#endif
+	}
+#ifdef HAVE_ALLOC_EVENT_post_successful_alloc_batch
+	if (nreported) DISPATCH_post_successful_alloc_batch(nreported, reported,
+		reported_modified_sizes, reported_sizes, caller);
+#endif
+	return out;
+}
+
+static void free_group(size_t n, void *const *userptrs, const void *caller)
+{
+	void *allocptrs[ALLOC_EVENT_BATCH_GROUP];
+	void *reported[ALLOC_EVENT_BATCH_GROUP] __attribute__((unused)); /* without post_nonnull_free handlers */
+	size_t nfreed = 0, nreported = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		void *userptr = userptrs[i];
+		if (!userptr) continue;
+		void *allocptr = USERPTR_TO_ALLOCPTR(userptr);
+		if (SAMPLE_FORGET(userptr))
+		{
+#ifdef NEED_FREED_USABLE_SIZE
+			if (DISPATCH_pre_nonnull_free(userptr, NEXT_HOOK(malloc_usable_size)(allocptr)))
+			{
+				/* the pre-hook can 'cancel' the free by returning nonzero */
+				(void) SAMPLE_REMEMBER(userptr);
+				continue;
+			}
+#endif
+			reported[nreported++] = userptr;
+		}
+		allocptrs[nfreed++] = allocptr;
+	}
+	if (nfreed) NEXT_HOOK(free_batch)(allocptrs, nfreed, caller);
+#ifdef HAVE_ALLOC_EVENT_post_nonnull_free_batch
+	if (nreported) DISPATCH_post_nonnull_free_batch(reported, nreported);
+#else
+	for (size_t i = 0; i < nreported; ++i) DISPATCH_post_nonnull_free(reported[i]);
+#endif
+}
+
+void OUR_HOOK(free_batch)(void *const *userptrs, size_t n, const void *caller)
+{
+	for (size_t done = 0; done < n; done += ALLOC_EVENT_BATCH_GROUP)
+	{
+		free_group(n - done < ALLOC_EVENT_BATCH_GROUP ? n - done : ALLOC_EVENT_BATCH_GROUP,
+			userptrs + done, caller);
+	}
+}
+
+/* All or nothing, so if a later group fails, we free the earlier ones. */
+void **OUR_HOOK(malloc_batch)(size_t n, const size_t *sizes, void **out, const void *caller)
+{
+	for (size_t done = 0; done < n; done += ALLOC_EVENT_BATCH_GROUP)
+	{
+		if (!malloc_group(n - done < ALLOC_EVENT_BATCH_GROUP ? n - done : ALLOC_EVENT_BATCH_GROUP,
+			sizes + done, out + done, caller))
+		{
+			OUR_HOOK(free_batch)(out, done, caller);
+			return NULL;
+		}
+	}
+	return out;
+}
+
 size_t OUR_HOOK(malloc_usable_size)(void *ptr)
 {
 	return NEXT_HOOK(malloc_usable_size)(ptr);
 }
+
+/* If our includer's pre_alloc may grow chunks, ask it how, and leave out
+ * what it adds, as if that were all at the chunk's end. */
+size_t OUR_HOOK(good_size)(size_t size, size_t alignment, const void *caller)
+{
+#ifndef PRE_ALLOC_PRESERVES_SIZE
+	size_t modified_size = size;
+	size_t modified_alignment = alignment ? alignment : sizeof (void *);
+	DISPATCH_pre_alloc(&modified_size, &modified_alignment, caller);
+	size_t good = NEXT_HOOK(good_size)(modified_size,
+		NEEDS_MEMALIGN(modified_alignment) ? modified_alignment : alignment, caller);
+	return good - (modified_size - size);
+#else
+	return NEXT_HOOK(good_size)(size, alignment, caller);
+#endif
+}
@@ -0,0 +1,321 @@
+/* A hook that keeps small freed chunks on per-CPU free lists, and serves
+ * small mallocs from them. Pushes and pops are restartable sequences
+ * (rseq): if the thread is preempted or migrated part way, the kernel
+ * restarts it, so the fast path needs no lock and no atomic read-modify-
+ * write. Unlike tcache.c, whose memory grows with the number of threads,
+ * ours grows with the number of CPUs, which suits processes with many
+ * mostly idle threads.
+ *
+ * Size classes work as in tcache.c. While a chunk is cached, its first two
+ * words hold the next chunk in its list and the length of the list from
+ * it down, so that a push or a pop commits with one store, to the list
+ * head. Cached chunks are never given back down the chain, but each list
+ * holds at most PERCPU_COUNT of them.
+ *
+ * We use glibc's rseq area if it has registered one (glibc 2.35 and later),
+ * and otherwise register our own, per thread. A thread for which neither
+ * works (say, the kernel has no rseq), or any thread on an architecture
+ * other than x86-64, passes every call through, to the allocator's own
+ * locked path. Other threads may still use the chunks it frees. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef OUR_HOOK
+#define OUR_HOOK(m) hook_ ## m
+#endif
+#ifndef NEXT_HOOK
+#define NEXT_HOOK(m) __terminal_hook_ ## m
+#endif
+
+/* Prototype the hooks we call... */
+#define HOOK_PREFIX(m) NEXT_HOOK(m)
+#include "mallochooks/hookapi.h"
+#undef HOOK_PREFIX
+/* ... and the ones we define. */
+#define HOOK_PREFIX(m) OUR_HOOK(m)
+#include "mallochooks/hookapi.h"
+#undef HOOK_PREFIX
+
+#ifndef PERCPU_CLASS_SIZE
+#define PERCPU_CLASS_SIZE 16 /* at least two words */
+#endif
+#ifndef PERCPU_MAX_SIZE
+#define PERCPU_MAX_SIZE 256 /* a multiple of PERCPU_CLASS_SIZE */
+#endif
+#ifndef PERCPU_COUNT
+#define PERCPU_COUNT 64 /* chunks per class per CPU */
+#endif
+#ifndef PERCPU_MAX_CPUS
+#define PERCPU_MAX_CPUS 256 /* higher-numbered CPUs pass through */
+#endif
+#define PERCPU_NCLASSES (PERCPU_MAX_SIZE / PERCPU_CLASS_SIZE)
+
+struct cached
+{
+	struct cached *next;
+	size_t depth;
+};
+/* Each CPU's list heads start on their own cache line. */
+struct percpu_lists
+{
+	struct cached *heads[PERCPU_NCLASSES];
+} __attribute__((aligned(64)));
+static struct percpu_lists lists[PERCPU_MAX_CPUS];
+
+/* Class i holds chunks of at least (i+1) * PERCPU_CLASS_SIZE bytes. */
+static inline unsigned class_for_request(size_t size)
+{
+	return size ? (size - 1) / PERCPU_CLASS_SIZE : 0;
+}
+static inline size_t class_size(unsigned i)
+{
+	return (size_t) (i + 1) * PERCPU_CLASS_SIZE;
+}
+
+#if defined(__x86_64__) && defined(__NR_rseq)
+#include <linux/rseq.h>
+#define RSEQ_SIG 0x53053053 /* what glibc registers with, on x86 */
+
+/* Where glibc put this thread's rseq area, if it registered one. Weak, so
+ * that we still link against an older glibc. */
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+
+/* Initial-exec, for the same reason as in terminal-indirect-dlsym.c. */
+static __thread struct rseq own_rseq __attribute__((tls_model("initial-exec")));
+static __thread struct rseq *rseq_area __attribute__((tls_model("initial-exec")));
+static __thread _Bool rseq_failed __attribute__((tls_model("initial-exec")));
+
+static __attribute__((noinline)) struct rseq *rseq_register(void)
+{
+	if (rseq_failed) return NULL;
+	if (&__rseq_size && __rseq_size != 0)
+	{
+		rseq_area = (struct rseq *) ((char *) __builtin_thread_pointer() + __rseq_offset);
+	}
+	else if (syscall(__NR_rseq, &own_rseq, sizeof own_rseq, 0, RSEQ_SIG) == 0)
+	{
+		rseq_area = &own_rseq;
+	}
+	else rseq_failed = 1;
+	return rseq_area;
+}
+static inline struct rseq *rseq_get(void)
+{
+	struct rseq *rs = rseq_area;
+	return __builtin_expect(rs != NULL, 1) ? rs : rseq_register();
+}
+
+/* The pieces of a restartable sequence, after the Linux selftests. The
+ * descriptor says where the sequence starts, where it has committed, and
+ * where to restart; the kernel checks that the abort handler is preceded
+ * by our signature (here, in a ud1 instruction, never executed). */
+#define str_(x) #x
+#define str(x) str_(x)
+#define RSEQ_DEFINE_CS(label, start, post_commit, abort) \
+	".pushsection __rseq_cs, \"aw\"\n\t" \
+	".balign 32\n\t" \
+	str(label) ":\n\t" \
+	".long 0x0, 0x0\n\t" \
+	".quad " str(start) ", " str(post_commit) " - " str(start) ", " str(abort) "\n\t" \
+	".popsection\n\t"
+#define RSEQ_START(cs_label, label) \
+	"leaq " str(cs_label) "(%%rip), %%rax\n\t" \
+	"movq %%rax, %[rseq_cs]\n\t" \
+	str(label) ":\n\t"
+#define RSEQ_DEFINE_ABORT(label, abort_label) \
+	".pushsection __rseq_failure, \"ax\"\n\t" \
+	".byte 0x0f, 0xb9, 0x3d\n\t" \
+	".long " str(RSEQ_SIG) "\n\t" \
+	str(label) ":\n\t" \
+	"jmp %l[" str(abort_label) "]\n\t" \
+	".popsection\n\t"
+
+/* Pop *head into *out, if we are on 'cpu'. Returns 1 if we did, 0 if the
+ * list was empty, or -1 if the sequence was restarted (try again). */
+static inline int rseq_pop(struct rseq *rs, unsigned cpu, struct cached **head, struct cached **out)
+{
+	__asm__ __volatile__ goto (
+		RSEQ_DEFINE_CS(3, 1f, 2f, 4f)
+		RSEQ_START(3b, 1)
+		"cmpl %[cpu], %[current_cpu]\n\t"
+		"jnz 4f\n\t"
+		"movq %[head], %%rbx\n\t"
+		"testq %%rbx, %%rbx\n\t"
+		"jz %l[empty]\n\t"
+		"movq %%rbx, %[out]\n\t"
+		"movq (%%rbx), %%rbx\n\t"
+		/* commit */
+		"movq %%rbx, %[head]\n\t"
+		"2:\n\t"
+		RSEQ_DEFINE_ABORT(4, aborted)
+		: /* no outputs */
+		: [cpu] "r" (cpu), [current_cpu] "m" (rs->cpu_id), [rseq_cs] "m" (rs->rseq_cs),
+		  [head] "m" (*head), [out] "m" (*out)
+		: "memory", "cc", "rax", "rbx"
+		: empty, aborted);
+	return 1;
+empty:
+	return 0;
+aborted:
+	return -1;
+}
+
+/* Push chunk onto *head, if we are on 'cpu' and the list is not full.
+ * Returns as rseq_pop does, with 0 meaning full. */
+static inline int rseq_push(struct rseq *rs, unsigned cpu, struct cached **head, struct cached *chunk)
+{
+	__asm__ __volatile__ goto (
+		RSEQ_DEFINE_CS(3, 1f, 2f, 4f)
+		RSEQ_START(3b, 1)
+		"cmpl %[cpu], %[current_cpu]\n\t"
+		"jnz 4f\n\t"
+		"movq %[head], %%rax\n\t"
+		"xorl %%ebx, %%ebx\n\t"
+		"testq %%rax, %%rax\n\t"
+		"jz 5f\n\t"
+		"movq 8(%%rax), %%rbx\n\t"
+		"cmpq %[max], %%rbx\n\t"
+		"jae %l[full]\n\t"
+		"5:\n\t"
+		"incq %%rbx\n\t"
+		"movq %%rax, (%[chunk])\n\t"
+		"movq %%rbx, 8(%[chunk])\n\t"
+		/* commit */
+		"movq %[chunk], %[head]\n\t"
+		"2:\n\t"
+		RSEQ_DEFINE_ABORT(4, aborted)
+		: /* no outputs */
+		: [cpu] "r" (cpu), [current_cpu] "m" (rs->cpu_id), [rseq_cs] "m" (rs->rseq_cs),
+		  [head] "m" (*head), [chunk] "r" (chunk), [max] "r" ((size_t) PERCPU_COUNT)
+		: "memory", "cc", "rax", "rbx"
+		: full, aborted);
+	return 1;
+full:
+	return 0;
+aborted:
+	return -1;
+}
+
+static inline void *percpu_get(unsigned i)
+{
+	struct rseq *rs = rseq_get();
+	if (!rs) return NULL;
+	for (;;)
+	{
+		unsigned cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+		if (cpu >= PERCPU_MAX_CPUS) return NULL;
+		struct cached *chunk;
+		int ret = rseq_pop(rs, cpu, &lists[cpu].heads[i], &chunk);
+		if (ret >= 0) return ret ? chunk : NULL;
+	}
+}
+/* Returns nonzero if we kept the chunk. */
+static inline _Bool percpu_put(void *ptr, unsigned i)
+{
+	struct rseq *rs = rseq_get();
+	if (!rs) return 0;
+	for (;;)
+	{
+		unsigned cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+		if (cpu >= PERCPU_MAX_CPUS) return 0;
+		int ret = rseq_push(rs, cpu, &lists[cpu].heads[i], ptr);
+		if (ret >= 0) return ret;
+	}
+}
+#else
+static inline void *percpu_get(unsigned i) { return NULL; }
+static inline _Bool percpu_put(void *ptr, unsigned i) { return 0; }
+#endif
+
+void OUR_HOOK(init)(void)
+{
+	NEXT_HOOK(init)();
+}
+
+void *OUR_HOOK(malloc)(size_t size, const void *caller)
+{
+	if (size > PERCPU_MAX_SIZE) return NEXT_HOOK(malloc)(size, caller);
+	unsigned i = class_for_request(size);
+	void *chunk = percpu_get(i);
+	if (chunk) return chunk;
+	return NEXT_HOOK(malloc)(class_size(i), caller);
+}
+
+/* As in tcache.c, calloc bypasses the cache, but rounds the size. */
+void *OUR_HOOK(calloc)(size_t nmemb, size_t size, const void *caller)
+{
+	size_t total;
+	if (!__builtin_mul_overflow(nmemb, size, &total) && total <= PERCPU_MAX_SIZE)
+	{
+		return NEXT_HOOK(calloc)(1, class_size(class_for_request(total)), caller);
+	}
+	return NEXT_HOOK(calloc)(nmemb, size, caller);
+}
+
+void OUR_HOOK(free)(void *ptr, const void *caller)
+{
+	if (ptr)
+	{
+		size_t usable = NEXT_HOOK(malloc_usable_size)(ptr);
+		if (usable >= PERCPU_CLASS_SIZE)
+		{
+			unsigned i = usable / PERCPU_CLASS_SIZE - 1;
+			if (i < PERCPU_NCLASSES && percpu_put(ptr, i)) return;
+		}
+	}
+	NEXT_HOOK(free)(ptr, caller);
+}
+
+void OUR_HOOK(free_sized)(void *ptr, size_t size, const void *caller)
+{
+	if (ptr && size >= PERCPU_CLASS_SIZE)
+	{
+		unsigned i = size / PERCPU_CLASS_SIZE - 1;
+		if (i < PERCPU_NCLASSES && percpu_put(ptr, i)) return;
+	}
+	NEXT_HOOK(free_sized)(ptr, size, caller);
+}
+
+void *OUR_HOOK(realloc)(void *ptr, size_t size, const void *caller)
+{
+	return NEXT_HOOK(realloc)(ptr, size, caller);
+}
+
+void *OUR_HOOK(realloc_in_place)(void *ptr, size_t size, const void *caller)
+{
+	return NEXT_HOOK(realloc_in_place)(ptr, size, caller);
+}
+
+void **OUR_HOOK(malloc_batch)(size_t n, const size_t *sizes, void **out, const void *caller)
+{
+	return NEXT_HOOK(malloc_batch)(n, sizes, out, caller);
+}
+
+void OUR_HOOK(free_batch)(void *const *ptrs, size_t n, const void *caller)
+{
+	NEXT_HOOK(free_batch)(ptrs, n, caller);
+}
+
+void *OUR_HOOK(memalign)(size_t alignment, size_t size, const void *caller)
+{
+	return NEXT_HOOK(memalign)(alignment, size, caller);
+}
+
+size_t OUR_HOOK(malloc_usable_size)(void *ptr)
+{
+	return NEXT_HOOK(malloc_usable_size)(ptr);
+}
+
+/* As in tcache.c, a small malloc may get a chunk only as big as its class. */
+size_t OUR_HOOK(good_size)(size_t size, size_t alignment, const void *caller)
+{
+	if (alignment || size > PERCPU_MAX_SIZE) return NEXT_HOOK(good_size)(size, alignment, caller);
+	return class_size(class_for_request(size));
+}
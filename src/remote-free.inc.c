@@ -0,0 +1,64 @@
+/* Remote-free lists, for terminals whose chunks each have an owner (a
+ * thread, an arena...) that alone may free them, and that can tell a
+ * chunk's owner from the chunk (terminal-mspace.c uses dlmalloc's
+ * FOOTERS). Another thread freeing a chunk pushes it on its owner's list,
+ * without locking anything of the owner's; the owner takes the whole list
+ * at once, at its next allocation, and frees the chunks in batches.
+ *
+ * Any number of threads push, and one takes, so this is multi-producer,
+ * single-consumer. Taking everything with one exchange means there is no
+ * ABA problem, as there would be for popping one chunk at a time. Chunks
+ * are linked through their first word. */
+
+#include <stddef.h>
+
+#ifndef REMOTE_FREE_GROUP
+#define REMOTE_FREE_GROUP 64
+#endif
+
+struct remote_frees
+{
+	void *head;
+};
+
+/* Push the chain first -> ... -> last, already linked, in one go. */
+static inline void remote_frees_push_chain(struct remote_frees *l, void *first, void *last)
+{
+	void *head = __atomic_load_n(&l->head, __ATOMIC_RELAXED);
+	do
+	{
+		*(void **) last = head;
+	} while (!__atomic_compare_exchange_n(&l->head, &head, first,
+			1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+static inline void remote_frees_push(struct remote_frees *l, void *chunk)
+{
+	remote_frees_push_chain(l, chunk, chunk);
+}
+
+/* A cheap check for the owner's fast path. */
+static inline _Bool remote_frees_pending(struct remote_frees *l)
+{
+	return __atomic_load_n(&l->head, __ATOMIC_RELAXED) != NULL;
+}
+
+/* Take every chunk pushed so far, and give them to release(), at most
+ * REMOTE_FREE_GROUP at a time, in an array it may overwrite. */
+static void remote_frees_drain(struct remote_frees *l,
+	void (*release)(void *arg, void **chunks, size_t n), void *arg)
+{
+	void *chunk = __atomic_exchange_n(&l->head, NULL, __ATOMIC_ACQUIRE);
+	void *group[REMOTE_FREE_GROUP];
+	size_t k = 0;
+	while (chunk)
+	{
+		group[k++] = chunk;
+		chunk = *(void **) chunk;
+		if (k == REMOTE_FREE_GROUP)
+		{
+			release(arg, group, k);
+			k = 0;
+		}
+	}
+	if (k) release(arg, group, k);
+}
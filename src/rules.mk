@@ -2,7 +2,9 @@
 # for some ELF DSO (incl. executable) that, when built, will define
 # a global, non-hidden, dynamic-exported 'malloc' symbol, along with
 # some or all of the other calls in the family (calloc, free, realloc,
-# memalign, posix_memalign, and possibly malloc_usable_size).
+# realloc_in_place, malloc_batch, free_batch,
+# memalign, posix_memalign, aligned_alloc, valloc, pvalloc, and possibly
+# malloc_usable_size, malloc_good_size and memalign_good_size).
 #
 # By including these makerules, hooks are generated and linked in to the
 # target binary, *replacing* the malloc entry points that would (possibly)
@@ -87,8 +89,24 @@ $(info MALLOCHOOKS_LIST is $(MALLOCHOOKS_LIST))
 mallochooks_mk := #
 LD ?= ld
 LD_R_FLAGS :=
+# With MALLOCHOOKS_LTO set, we build our objects with -flto and do the
+# relocatable link through the compiler, which then optimises the whole
+# chain at once: the hooks are all hidden, so user2hook's entry points,
+# the hooks and the terminal can inline into one another. The output is
+# ordinary code, so the target's own link need not use LTO. (GCC keeps
+# the output of an LTO relocatable link as bytecode unless told not to;
+# other compilers may need MALLOCHOOKS_LTO_R_FLAGS set differently.)
+ifeq ($(MALLOCHOOKS_LTO),)
 mallochooks.o:
 	$(LD) -r -o $@ $+ $(LD_R_FLAGS)
+else
+MALLOCHOOKS_LTO_FLAGS ?= -flto
+MALLOCHOOKS_LTO_R_FLAGS ?= -flinker-output=nolto-rel
+comma := ,
+mallochooks.o:
+	$(CC) -r -nostdlib -o $@ $+ $(CFLAGS) $(MALLOCHOOKS_LTO_FLAGS) $(MALLOCHOOKS_LTO_R_FLAGS) \
+	  $(patsubst %,-Wl$(comma)%,$(LD_R_FLAGS))
+endif
 mallochooks.mk:
 	echo '$(mallochooks_mk)' > "$@" || (rm -f "$@"; false)
 
@@ -99,6 +117,9 @@ vpath %.c $(srcdir)
 # our source files need our includes
 objs := $(patsubst %.c,%.o,$(shell cd $(srcdir) && ls *.c))
 $(objs): CFLAGS += -I$(srcdir)/../include
+ifneq ($(MALLOCHOOKS_LTO),)
+$(objs): CFLAGS += $(MALLOCHOOKS_LTO_FLAGS)
+endif
 
 # we depend on our hook .o files
 mallochooks.o: $(patsubst %,%.o,$(MALLOCHOOKS_LIST))
@@ -118,24 +139,74 @@ user2hook.o: CFLAGS += -D'HOOK_PREFIX(x)=$(first_hook_prefix)\#\#x' \
 # preload case, but that's fine because it should not directly
 # reference the real malloc as termination. It may reference it to
 # call malloc, but then it should get us. So all good?
-mallochooks_mk := $(MALLOCHOOKS_TARGET): LDFLAGS += \
+MALLOCHOOKS_WRAP_LDFLAGS := \
  -Wl,--wrap,malloc \
  -Wl,--wrap,calloc \
  -Wl,--wrap,realloc \
+ -Wl,--wrap,realloc_in_place \
  -Wl,--wrap,free \
+ -Wl,--wrap,free_sized \
+ -Wl,--wrap,free_aligned_sized \
+ -Wl,--wrap,malloc_batch \
+ -Wl,--wrap,free_batch \
  -Wl,--wrap,memalign \
- -Wl,--wrap,posix_memalign
+ -Wl,--wrap,posix_memalign \
+ -Wl,--wrap,aligned_alloc \
+ -Wl,--wrap,valloc \
+ -Wl,--wrap,pvalloc \
+ -Wl,--wrap,malloc_usable_size \
+ -Wl,--wrap,malloc_good_size \
+ -Wl,--wrap,memalign_good_size
+# the names we take over from the target
+mallochooks_syms := malloc calloc realloc realloc_in_place free free_sized free_aligned_sized \
+ malloc_batch free_batch memalign posix_memalign aligned_alloc valloc pvalloc \
+ malloc_usable_size malloc_good_size memalign_good_size
+# With MALLOCHOOKS_SIZED_DELETE set, we also take over C++'s sized operator
+# delete (see user2hook.c), so that the sizes C++ knows reach free_sized.
+ifneq ($(MALLOCHOOKS_SIZED_DELETE),)
+user2hook.o: CFLAGS += -DMALLOC_SIZED_DELETE
+mallochooks_syms += _ZdlPvm _ZdaPvm _ZdlPvmSt11align_val_t _ZdaPvmSt11align_val_t
+MALLOCHOOKS_WRAP_LDFLAGS += \
+ -Wl,--wrap,_ZdlPvm \
+ -Wl,--wrap,_ZdaPvm \
+ -Wl,--wrap,_ZdlPvmSt11align_val_t \
+ -Wl,--wrap,_ZdaPvmSt11align_val_t
+endif
+mallochooks_mk := $(MALLOCHOOKS_TARGET): LDFLAGS += $(MALLOCHOOKS_WRAP_LDFLAGS)
 
 clean::
 	rm -f mallochooks.mk
 
-# now the terminal case
-ifneq ($(words $(MALLOCHOOKS_LIST)),1)
-$(word $(words $(MALLOCHOOKS_LIST)) $(MALLOCHOOKS_LIST)).o: CFLAGS += \
- -D__next_hook_malloc=__terminal_hook_malloc \
- -D__next_hook_realloc=__terminal_hook_realloc \
- -D__next_hook_free=__terminal_hook_free \
- -D__next_hook_memalign=__terminal_hook_memalign
+# If the includer lists the events it handles in MALLOCHOOKS_EVENTS
+# (e.g. 'post_successful_alloc pre_nonnull_free'), hook2event is built
+# specialised to those, and the calls to the others compile away.
+ifneq ($(MALLOCHOOKS_EVENTS),)
+hook2event.o: CFLAGS += -DALLOC_EVENTS_EXPLICIT \
+ $(foreach e,$(MALLOCHOOKS_EVENTS),-DHAVE_ALLOC_EVENT_$(e))
+endif
+
+# With terminal-select as the terminal, MALLOCHOOKS_SELECT lists the
+# terminals it chooses between at startup (see terminal-select.c), the
+# first being the default. Each gets its own prefix, so they can all be
+# linked in at once. The list may also name a hook (e.g. slab), which is
+# then a choice of its own, stacked over the first terminal in the list.
+ifeq ($(lastword $(MALLOCHOOKS_LIST)),terminal-select)
+MALLOCHOOKS_SELECT ?= terminal-indirect-dlsym
+select_name = $(patsubst terminal-%,%,$(1))
+select_prefix = __terminal_$(subst -,_,$(call select_name,$(1)))_hook_
+select_base := $(firstword $(filter terminal-%,$(MALLOCHOOKS_SELECT)))
+ifeq ($(select_base),)
+$(error MALLOCHOOKS_SELECT must list at least one terminal)
+endif
+define set_cflags_for_select_backend
+$(1).o: CFLAGS += -DTERMINAL_SELECT_BACKEND -D'OUR_HOOK(m)=$(call select_prefix,$(1))\#\#m' \
+ $(if $(filter terminal-%,$(1)),,-D'NEXT_HOOK(m)=$(call select_prefix,$(select_base))\#\#m')
+endef
+$(foreach b,$(MALLOCHOOKS_SELECT),$(eval $(call set_cflags_for_select_backend,$(b))))
+terminal-select.o: CFLAGS += \
+ $(foreach b,$(MALLOCHOOKS_SELECT),-DTERMINAL_SELECT_HAVE_$(subst -,_,$(call select_name,$(b)))) \
+ -D'TERMINAL_SELECT_DEFAULT="$(call select_name,$(firstword $(MALLOCHOOKS_SELECT)))"'
+mallochooks.o: $(patsubst %,%.o,$(MALLOCHOOKS_SELECT))
 endif
 
 # FIXME: move this to an example (using librunt/relf.h)
@@ -143,27 +214,39 @@ terminal-indirect-dlsym.o: CFLAGS += \
   -Ddlsym_nomalloc=fake_dlsym -include assert.h -include stdlib.h -include link.h -I$(LIBRUNT_INCLUDE) -include relf.h
 
 # now the cases in the middle
-# for each source file in the list, except for the last one,
-# define its next_hook to be the prefix
+# for each source file in the list, except for the last (terminal) one,
+# name its hooks by its position, and point its next hooks at the
+# following entry, which for the last of them is the terminal.
+# Hook sources see both OUR_HOOK/NEXT_HOOK and the older per-call
+# __next_hook_XXX names.
+hook_prefix_after = $(if $(filter $(shell expr $(1) + 1),$(words $(MALLOCHOOKS_LIST))),__terminal_hook_,__hook$(shell expr $(1) + 1)_)
 define set_cflags_for_nonterminal_hooks
-$(word $(1) $(MALLOCHOOKS_LIST)).o: CFLAGS += \
- -D__next_hook_malloc=__hook$(shell expr $(1) + 1)_malloc \
- -D__next_hook_realloc=__hook$(shell expr $(1) + 1)_realloc \
- -D__next_hook_free=__hook$(shell expr $(1) + 1)_free \
- -D__next_hook_memalign=__hook$(shell expr $(1) + 1)_memalign
+$(word $(1),$(MALLOCHOOKS_LIST)).o: CFLAGS += \
+ -D'OUR_HOOK(m)=__hook$(1)_\#\#m' \
+ -D'NEXT_HOOK(m)=$(call hook_prefix_after,$(1))\#\#m' \
+ -D__next_hook_malloc=$(call hook_prefix_after,$(1))malloc \
+ -D__next_hook_calloc=$(call hook_prefix_after,$(1))calloc \
+ -D__next_hook_realloc=$(call hook_prefix_after,$(1))realloc \
+ -D__next_hook_realloc_in_place=$(call hook_prefix_after,$(1))realloc_in_place \
+ -D__next_hook_free=$(call hook_prefix_after,$(1))free \
+ -D__next_hook_free_sized=$(call hook_prefix_after,$(1))free_sized \
+ -D__next_hook_malloc_batch=$(call hook_prefix_after,$(1))malloc_batch \
+ -D__next_hook_free_batch=$(call hook_prefix_after,$(1))free_batch \
+ -D__next_hook_memalign=$(call hook_prefix_after,$(1))memalign \
+ -D__next_hook_good_size=$(call hook_prefix_after,$(1))good_size
 endef
 
 # our hook indices are 1-based
 # if we have ... words in the hooks list, the foreach below iterates over the list ...
-#             1                           []   # no terminal case (handled by first_hook_prefix above)
-#             2                           []   # + terminal case
-#             3                           [1]  # + terminal case
-#             4                           [1,2]# + terminal case
-# always defining __next_hook_XXX=__hookN+1_XXX
+#             1                           []     # no hooks (handled by first_hook_prefix above)
+#             2                           [1]    # 1 calls the terminal
+#             3                           [1,2]  # 2 calls the terminal
+#             4                           [1,2,3]# 3 calls the terminal
+# always defining NEXT_HOOK to be __hookN+1_ (or the terminal)
 #    for each N in the list
 #    *in hook object N*
-$(foreach n,$(shell seq 1 $(shell expr $(words $(MALLOCHOOKS_LIST)) - 3)),\
-$(call set_cflags_for_nonterminal_hooks,$(n)))
+$(foreach n,$(shell seq 1 $(shell expr $(words $(MALLOCHOOKS_LIST)) - 1)),\
+$(eval $(call set_cflags_for_nonterminal_hooks,$(n))))
 
 mallochooks.o: $(TERMINAL_HOOKS)
 
@@ -179,9 +262,9 @@ $(MALLOCHOOKS_TARGET):
 $(MALLOCHOOKS_TARGET):
 	$(MAKE) NO_TARGET_OVERRIDE=1 -f $(firstword $(MAKEFILE_LIST)) $@
 	( \
-	$(OBJCOPY) `for s in malloc calloc realloc free memalign posix_memalign; do echo --redefine-sym "$$s"=_"$$s"; done` $@ && \
+	$(OBJCOPY) `for s in $(mallochooks_syms); do echo --redefine-sym "$$s"=_"$$s"; done` $@ && \
 	$(SYM2DYN) $@ && \
-	$(OBJCOPY) `for s in malloc calloc realloc free memalign posix_memalign; do echo --redefine-sym __wrap_"$$s"="$$s"; done` $@ && \
+	$(OBJCOPY) `for s in $(mallochooks_syms); do echo --redefine-sym __wrap_"$$s"="$$s"; done` $@ && \
 	$(SYM2DYN) $@ && \
 	true ) || (rm -f $@; false)
 endif
@@ -0,0 +1,194 @@
+/* Byte-based Poisson sampling for hook2event.c, which includes us when
+ * ALLOC_EVENT_SAMPLE_BYTES is defined (to the mean number of bytes
+ * allocated between samples).
+ *
+ * As in tcmalloc, each thread counts down the bytes it allocates, and
+ * the allocation that takes the count to zero is sampled; the count is
+ * then reset to an exponentially distributed value, so that every byte
+ * is equally likely to be sampled. A sampled chunk is remembered in a
+ * fixed-size, lock-free pointer set, so that its free (or realloc) is
+ * reported too; nothing else is. A sample of size s stands for roughly
+ * s / (1 - exp(-s / ALLOC_EVENT_SAMPLE_BYTES)) bytes of allocation.
+ *
+ * pre_alloc is never sampled, since it shapes the chunk: an includer
+ * that wants the unsampled path to be just the countdown should not
+ * have a pre_alloc handler (see ALLOC_EVENTS_EXPLICIT). */
+
+#include <stdint.h>
+#include <time.h>     /* for clock_gettime */
+#include <sched.h>    /* for sched_yield */
+#include <sys/mman.h>
+
+#ifndef SAMPLE_TABLE_SLOTS
+#define SAMPLE_TABLE_SLOTS (1ul<<16) /* most sampled chunks live at once; power of two */
+#endif
+#ifndef SAMPLE_MAX_PROBES
+#define SAMPLE_MAX_PROBES 64
+#endif
+#define SAMPLE_SLOT_EMPTY ((void*) 0)
+
+static __thread long sample_countdown __attribute__((tls_model("initial-exec")));
+static __thread uint64_t sample_rng __attribute__((tls_model("initial-exec")));
+static void **sample_table;
+static unsigned long sampled_live;
+/* Changes to the table are serialised by sample_lock. A removal shifts
+ * later entries back into the hole, as in Robin Hood hashing, so there
+ * are no tombstones and a miss stops at the first empty slot; it makes
+ * sample_seq odd while it does, and a lookup that misses while (or
+ * since) that happened looks again. */
+static int sample_lock;
+static unsigned long sample_seq;
+
+/* An exponent from the bits, plus a quadratic for the mantissa; good to a
+ * few parts in a thousand, which is plenty, and it saves us libm. */
+static double sample_fast_log2(double x)
+{
+	union { double d; uint64_t u; } v = { x };
+	int exponent = (int) ((v.u >> 52) & 0x7ff) - 1023;
+	v.u = (v.u & ((1ull << 52) - 1)) | (1023ull << 52);
+	double m = v.d;
+	return exponent + (-0.34484843 * m + 2.02466578) * m - 0.67487759;
+}
+
+static long sample_next_interval(void)
+{
+	/* xorshift64* */
+	sample_rng ^= sample_rng >> 12;
+	sample_rng ^= sample_rng << 25;
+	sample_rng ^= sample_rng >> 27;
+	uint64_t r = sample_rng * 0x2545F4914F6CDD1Dull;
+	double u = (double) ((r >> 11) + 1) * 0x1.0p-53; /* in (0, 1] */
+	double interval = -sample_fast_log2(u) * 0.6931471805599453 * (ALLOC_EVENT_SAMPLE_BYTES);
+	return (long) interval + 1;
+}
+
+static _Bool sample_alloc_slow(size_t size)
+{
+	if (!sample_rng)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		sample_rng = ((uint64_t) (uintptr_t) &sample_rng * 0x9E3779B97F4A7C15ull)
+			^ (uint64_t) now.tv_nsec ^ ((uint64_t) now.tv_sec << 32);
+		if (!sample_rng) sample_rng = 1;
+		sample_countdown = sample_next_interval() - (long) size;
+		if (sample_countdown > 0) return 0;
+	}
+	sample_countdown = sample_next_interval();
+	return 1;
+}
+
+static inline _Bool sample_alloc(size_t size)
+{
+	if (__builtin_expect((sample_countdown -= (long) size) > 0, 1)) return 0;
+	return sample_alloc_slow(size);
+}
+
+static inline size_t sample_slot(const void *userptr, unsigned i)
+{
+	return ((((uintptr_t) userptr * 0x9E3779B97F4A7C15ull) >> 32) + i) & (SAMPLE_TABLE_SLOTS - 1);
+}
+
+static void sample_lock_acquire(void)
+{
+	while (__atomic_exchange_n(&sample_lock, 1, __ATOMIC_ACQUIRE)) sched_yield();
+}
+static void sample_lock_release(void)
+{
+	__atomic_store_n(&sample_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* If the set is full, the chunk goes unreported, so its free does too. */
+static _Bool sample_remember(void *userptr)
+{
+	void **table = __atomic_load_n(&sample_table, __ATOMIC_ACQUIRE);
+	if (__builtin_expect(!table, 0))
+	{
+		void **new_table = mmap(NULL, SAMPLE_TABLE_SLOTS * sizeof (void*), PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (new_table == MAP_FAILED) return 0;
+		if (!__atomic_compare_exchange_n(&sample_table, &table, new_table,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			munmap(new_table, SAMPLE_TABLE_SLOTS * sizeof (void*));
+		}
+		else table = new_table;
+	}
+	_Bool remembered = 0;
+	sample_lock_acquire();
+	/* Removal needs an empty slot to stop at. */
+	if (sampled_live < SAMPLE_TABLE_SLOTS - 1) for (unsigned i = 0; i < SAMPLE_MAX_PROBES; ++i)
+	{
+		void **slot = &table[sample_slot(userptr, i)];
+		if (*slot == SAMPLE_SLOT_EMPTY)
+		{
+			/* Lookups don't stop at an entry, so need no sample_seq. */
+			__atomic_store_n(slot, userptr, __ATOMIC_RELEASE);
+			__atomic_add_fetch(&sampled_live, 1, __ATOMIC_RELAXED);
+			remembered = 1;
+			break;
+		}
+	}
+	sample_lock_release();
+	return remembered;
+}
+
+static size_t sample_find(void **table, const void *userptr)
+{
+	for (unsigned i = 0; i < SAMPLE_MAX_PROBES; ++i)
+	{
+		size_t pos = sample_slot(userptr, i);
+		void *seen = __atomic_load_n(&table[pos], __ATOMIC_RELAXED);
+		if (seen == SAMPLE_SLOT_EMPTY) break;
+		if (seen == userptr) return pos;
+	}
+	return (size_t) -1;
+}
+
+static _Bool sample_forget_slow(void **table, void *userptr)
+{
+	sample_lock_acquire();
+	size_t hole = sample_find(table, userptr);
+	if (hole == (size_t) -1) { sample_lock_release(); return 0; }
+	__atomic_store_n(&sample_seq, sample_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	/* Move back any entry after the hole that may sit in it, i.e. whose
+	 * home slot is no later than the hole's, until an empty slot. */
+	for (size_t pos = (hole + 1) & (SAMPLE_TABLE_SLOTS - 1); ;
+			pos = (pos + 1) & (SAMPLE_TABLE_SLOTS - 1))
+	{
+		void *entry = table[pos];
+		if (entry == SAMPLE_SLOT_EMPTY) break;
+		size_t home = sample_slot(entry, 0);
+		if (((pos - home) & (SAMPLE_TABLE_SLOTS - 1)) >= ((pos - hole) & (SAMPLE_TABLE_SLOTS - 1)))
+		{
+			__atomic_store_n(&table[hole], entry, __ATOMIC_RELAXED);
+			hole = pos;
+		}
+	}
+	__atomic_store_n(&table[hole], SAMPLE_SLOT_EMPTY, __ATOMIC_RELAXED);
+	__atomic_store_n(&sample_seq, sample_seq + 1, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&sampled_live, 1, __ATOMIC_RELAXED);
+	sample_lock_release();
+	return 1;
+}
+
+/* The common case, with nothing sampled, is one load; a miss with
+ * something sampled is a few more, since the table has no tombstones. */
+static inline _Bool sample_forget(void *userptr)
+{
+	if (__builtin_expect(__atomic_load_n(&sampled_live, __ATOMIC_RELAXED) == 0, 1)) return 0;
+	void **table = __atomic_load_n(&sample_table, __ATOMIC_ACQUIRE);
+	unsigned long seq;
+	do
+	{
+		seq = __atomic_load_n(&sample_seq, __ATOMIC_ACQUIRE);
+		if (sample_find(table, userptr) != (size_t) -1) return sample_forget_slow(table, userptr);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&sample_seq, __ATOMIC_RELAXED));
+	return 0;
+}
+
+#define SAMPLE_ALLOC(size) sample_alloc(size)
+#define SAMPLE_REMEMBER(userptr) sample_remember(userptr)
+#define SAMPLE_FORGET(userptr) sample_forget(userptr)
@@ -0,0 +1,399 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* A hook that serves small requests from slabs, one size class per slab,
+ * with no per-chunk header, and passes everything else on down the chain.
+ *
+ * All slabs come from one virtual range, reserved (PROT_NONE) the first
+ * time we need a slab and made accessible a few slabs at a time, so any
+ * pointer is ours iff it is in that range: free, realloc and
+ * malloc_usable_size need one range check to tell. A slab is SLAB_SIZE
+ * bytes, aligned to that, and starts with a header saying its class and
+ * which of its slots are free (a bitmap), so a chunk's slab is its
+ * address masked. When the range runs out, small requests go down the
+ * chain too, rounded up to their class's size.
+ *
+ * Each class has a list of its slabs that have a free slot, under a lock.
+ * A slab that becomes wholly free is given back to the system (madvise)
+ * and to a shared list of empty slabs, for any class, unless it is its
+ * class's only partly-free slab. We never allocate while holding a lock,
+ * so re-entry from below is harmless. For per-thread caching, put tcache
+ * in front. */
+
+#ifndef OUR_HOOK
+#define OUR_HOOK(m) hook_ ## m
+#endif
+#ifndef NEXT_HOOK
+#define NEXT_HOOK(m) __terminal_hook_ ## m
+#endif
+
+/* Prototype the hooks we call... */
+#define HOOK_PREFIX(m) NEXT_HOOK(m)
+#include "mallochooks/hookapi.h"
+#undef HOOK_PREFIX
+/* ... and the ones we define. */
+#define HOOK_PREFIX(m) OUR_HOOK(m)
+#include "mallochooks/hookapi.h"
+#undef HOOK_PREFIX
+
+#ifndef SLAB_CLASS_SIZE
+#define SLAB_CLASS_SIZE 16 /* also the alignment of every slot */
+#endif
+#ifndef SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE 128 /* a multiple of SLAB_CLASS_SIZE */
+#endif
+#ifndef SLAB_SIZE
+#define SLAB_SIZE 4096 /* a power of two, and a multiple of the page size */
+#endif
+#ifndef SLAB_REGION_SIZE
+#define SLAB_REGION_SIZE (sizeof (void *) == 8 ? (1ul<<32) : (1ul<<26))
+#endif
+#ifndef SLAB_COMMIT_SLABS
+#define SLAB_COMMIT_SLABS 64 /* slabs made accessible at a time */
+#endif
+#ifndef SLAB_BATCH_GROUP
+#define SLAB_BATCH_GROUP 64
+#endif
+#define SLAB_NCLASSES (SLAB_MAX_SIZE / SLAB_CLASS_SIZE)
+#define SLAB_BITMAP_WORDS ((SLAB_SIZE / SLAB_CLASS_SIZE + 63) / 64)
+
+struct slab
+{
+	struct slab *next, *prev; /* in its class's list of slabs with a free slot */
+	unsigned short class;
+	unsigned short nfree;
+	uint64_t free_bits[SLAB_BITMAP_WORDS]; /* set for a free slot */
+};
+#define SLAB_HEADER_SIZE ((sizeof (struct slab) + SLAB_CLASS_SIZE - 1) & ~(size_t) (SLAB_CLASS_SIZE - 1))
+
+struct slab_class
+{
+	pthread_mutex_t lock;
+	struct slab *partial;
+};
+static struct slab_class classes[SLAB_NCLASSES] = {
+	[0 ... SLAB_NCLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL }
+};
+_Static_assert(SLAB_SIZE / SLAB_CLASS_SIZE <= 65535, "slabs too big for nfree");
+
+/* Where slabs come from. region_base and region_size are written once,
+ * before any chunk of ours exists. */
+static uintptr_t region_base;
+static size_t region_size;
+static pthread_mutex_t pages_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Bool region_failed;
+static char *region_next;      /* the next never-used slab */
+static char *region_committed; /* the end of what we've made accessible */
+static struct slab *empty_slabs;
+
+/* Class i holds chunks of (i+1) * SLAB_CLASS_SIZE bytes. */
+static inline unsigned class_for_request(size_t size)
+{
+	return size ? (size - 1) / SLAB_CLASS_SIZE : 0;
+}
+static inline size_t class_size(unsigned i)
+{
+	return (size_t) (i + 1) * SLAB_CLASS_SIZE;
+}
+static inline unsigned class_capacity(unsigned i)
+{
+	return (SLAB_SIZE - SLAB_HEADER_SIZE) / class_size(i);
+}
+
+static inline _Bool is_ours(const void *ptr)
+{
+	/* The size first: once it's nonzero, the base is right. */
+	size_t size = __atomic_load_n(&region_size, __ATOMIC_ACQUIRE);
+	return (uintptr_t) ptr - __atomic_load_n(&region_base, __ATOMIC_RELAXED) < size;
+}
+static inline struct slab *slab_of(const void *ptr)
+{
+	return (struct slab *) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_SIZE - 1));
+}
+static inline size_t chunk_size(const void *ptr)
+{
+	return class_size(slab_of(ptr)->class);
+}
+
+/* Caller holds pages_lock. */
+static _Bool reserve_region(void)
+{
+	if (region_failed) return 0;
+	/* Over-reserve so that we can align to SLAB_SIZE. */
+	size_t size = SLAB_REGION_SIZE;
+	char *mapping = mmap(NULL, size + SLAB_SIZE, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mapping == MAP_FAILED) { region_failed = 1; return 0; }
+	char *base = (char *) (((uintptr_t) mapping + SLAB_SIZE - 1) & ~(uintptr_t) (SLAB_SIZE - 1));
+	region_next = region_committed = base;
+	__atomic_store_n(&region_base, (uintptr_t) base, __ATOMIC_RELAXED);
+	__atomic_store_n(&region_size, size, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* A slab for class i, with every slot free, not on any list. */
+static struct slab *new_slab(unsigned i)
+{
+	struct slab *s = NULL;
+	pthread_mutex_lock(&pages_lock);
+	if (empty_slabs)
+	{
+		s = empty_slabs;
+		empty_slabs = s->next;
+	}
+	else if (region_size || reserve_region())
+	{
+		char *end = (char *) region_base + region_size;
+		if (region_next == region_committed && region_committed != end)
+		{
+			size_t step = SLAB_COMMIT_SLABS * (size_t) SLAB_SIZE;
+			if (step > (size_t) (end - region_committed)) step = end - region_committed;
+			if (0 == mprotect(region_committed, step, PROT_READ | PROT_WRITE))
+			{
+				region_committed += step;
+			}
+		}
+		if (region_next != region_committed)
+		{
+			s = (struct slab *) region_next;
+			region_next += SLAB_SIZE;
+		}
+	}
+	pthread_mutex_unlock(&pages_lock);
+	if (!s) return NULL;
+	unsigned n = class_capacity(i);
+	s->next = s->prev = NULL;
+	s->class = i;
+	s->nfree = n;
+	for (unsigned w = 0; w < SLAB_BITMAP_WORDS; ++w)
+	{
+		s->free_bits[w] = n >= 64 * (w + 1) ? ~(uint64_t) 0
+			: n <= 64 * w ? 0
+			: ((uint64_t) 1 << (n - 64 * w)) - 1;
+	}
+	return s;
+}
+
+/* The slab is wholly free and on no list. Its pages go back to the system,
+ * though it stays accessible, and come back zeroed when touched. */
+static void release_slab(struct slab *s)
+{
+	madvise(s, SLAB_SIZE, MADV_DONTNEED);
+	pthread_mutex_lock(&pages_lock);
+	s->next = empty_slabs;
+	empty_slabs = s;
+	pthread_mutex_unlock(&pages_lock);
+}
+
+/* Caller holds the class's lock. */
+static inline void partial_push(struct slab_class *c, struct slab *s)
+{
+	s->prev = NULL;
+	s->next = c->partial;
+	if (c->partial) c->partial->prev = s;
+	c->partial = s;
+}
+static inline void partial_remove(struct slab_class *c, struct slab *s)
+{
+	if (s->prev) s->prev->next = s->next; else c->partial = s->next;
+	if (s->next) s->next->prev = s->prev;
+	s->next = s->prev = NULL;
+}
+
+static void *slab_alloc(unsigned i)
+{
+	struct slab_class *c = &classes[i];
+	pthread_mutex_lock(&c->lock);
+	struct slab *s = c->partial;
+	if (!s)
+	{
+		/* Don't hold our lock while taking pages_lock. */
+		pthread_mutex_unlock(&c->lock);
+		struct slab *fresh = new_slab(i);
+		if (!fresh) return NULL;
+		pthread_mutex_lock(&c->lock);
+		partial_push(c, fresh);
+		s = c->partial;
+	}
+	unsigned w = 0;
+	while (!s->free_bits[w]) ++w;
+	unsigned bit = __builtin_ctzll(s->free_bits[w]);
+	s->free_bits[w] &= ~((uint64_t) 1 << bit);
+	if (--s->nfree == 0) partial_remove(c, s);
+	pthread_mutex_unlock(&c->lock);
+	return (char *) s + SLAB_HEADER_SIZE + (64 * w + bit) * class_size(i);
+}
+
+static void slab_free(void *ptr)
+{
+	struct slab *s = slab_of(ptr);
+	unsigned i = s->class;
+	struct slab_class *c = &classes[i];
+	unsigned slot = ((char *) ptr - (char *) s - SLAB_HEADER_SIZE) / class_size(i);
+	uint64_t mask = (uint64_t) 1 << (slot % 64);
+	_Bool release = 0;
+	pthread_mutex_lock(&c->lock);
+	assert(!(s->free_bits[slot / 64] & mask)); /* double free */
+	s->free_bits[slot / 64] |= mask;
+	if (s->nfree++ == 0) partial_push(c, s);
+	else if (s->nfree == class_capacity(i) && (s->prev || s->next))
+	{
+		partial_remove(c, s);
+		release = 1;
+	}
+	pthread_mutex_unlock(&c->lock);
+	if (release) release_slab(s);
+}
+
+void OUR_HOOK(init)(void)
+{
+	NEXT_HOOK(init)();
+}
+
+void *OUR_HOOK(malloc)(size_t size, const void *caller)
+{
+	if (size <= SLAB_MAX_SIZE)
+	{
+		unsigned i = class_for_request(size);
+		void *chunk = slab_alloc(i);
+		if (chunk) return chunk;
+		size = class_size(i);
+	}
+	return NEXT_HOOK(malloc)(size, caller);
+}
+
+/* Slots are reused, so we must zero them. */
+void *OUR_HOOK(calloc)(size_t nmemb, size_t size, const void *caller)
+{
+	size_t total;
+	if (!__builtin_mul_overflow(nmemb, size, &total) && total <= SLAB_MAX_SIZE)
+	{
+		unsigned i = class_for_request(total);
+		void *chunk = slab_alloc(i);
+		if (chunk) return memset(chunk, 0, total);
+		return NEXT_HOOK(calloc)(1, class_size(i), caller);
+	}
+	return NEXT_HOOK(calloc)(nmemb, size, caller);
+}
+
+void OUR_HOOK(free)(void *ptr, const void *caller)
+{
+	if (is_ours(ptr)) slab_free(ptr);
+	else NEXT_HOOK(free)(ptr, caller);
+}
+
+void OUR_HOOK(free_sized)(void *ptr, size_t size, const void *caller)
+{
+	if (is_ours(ptr)) slab_free(ptr);
+	else NEXT_HOOK(free_sized)(ptr, size, caller);
+}
+
+/* A chunk of ours that outgrows its slot moves, maybe to a bigger class,
+ * maybe down the chain. Chunks from below stay there, whatever their
+ * new size. */
+void *OUR_HOOK(realloc)(void *ptr, size_t size, const void *caller)
+{
+	if (!ptr) return OUR_HOOK(malloc)(size, caller);
+	if (!is_ours(ptr)) return NEXT_HOOK(realloc)(ptr, size, caller);
+	size_t old_size = chunk_size(ptr);
+	if (size <= old_size) return ptr;
+	void *new_ptr = OUR_HOOK(malloc)(size, caller);
+	if (!new_ptr) return NULL;
+	memcpy(new_ptr, ptr, old_size);
+	slab_free(ptr);
+	return new_ptr;
+}
+
+void *OUR_HOOK(realloc_in_place)(void *ptr, size_t size, const void *caller)
+{
+	if (!is_ours(ptr)) return NEXT_HOOK(realloc_in_place)(ptr, size, caller);
+	return size <= chunk_size(ptr) ? ptr : NULL;
+}
+
+/* We take the small chunks, and pass the rest down in groups, as one
+ * batch each. If a group fails, free everything so far and fail. */
+void **OUR_HOOK(malloc_batch)(size_t n, const size_t *sizes, void **out, const void *caller)
+{
+	for (size_t start = 0; start < n; start += SLAB_BATCH_GROUP)
+	{
+		size_t end = n - start < SLAB_BATCH_GROUP ? n : start + SLAB_BATCH_GROUP;
+		size_t down_sizes[SLAB_BATCH_GROUP];
+		size_t down_index[SLAB_BATCH_GROUP];
+		void *down_out[SLAB_BATCH_GROUP];
+		size_t m = 0;
+		for (size_t i = start; i < end; ++i)
+		{
+			size_t size = sizes[i];
+			out[i] = NULL;
+			if (size <= SLAB_MAX_SIZE)
+			{
+				unsigned c = class_for_request(size);
+				out[i] = slab_alloc(c);
+				size = class_size(c);
+			}
+			if (!out[i])
+			{
+				down_sizes[m] = size;
+				down_index[m++] = i;
+			}
+		}
+		if (m == 0) continue;
+		if (!NEXT_HOOK(malloc_batch)(m, down_sizes, down_out, caller))
+		{
+			OUR_HOOK(free_batch)(out, end, caller); /* this group's misses are null */
+			return NULL;
+		}
+		for (size_t k = 0; k < m; ++k) out[down_index[k]] = down_out[k];
+	}
+	return out;
+}
+
+void OUR_HOOK(free_batch)(void *const *ptrs, size_t n, const void *caller)
+{
+	void *down[SLAB_BATCH_GROUP];
+	size_t m = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (!ptrs[i]) continue;
+		if (is_ours(ptrs[i])) { slab_free(ptrs[i]); continue; }
+		down[m++] = ptrs[i];
+		if (m == SLAB_BATCH_GROUP)
+		{
+			NEXT_HOOK(free_batch)(down, m, caller);
+			m = 0;
+		}
+	}
+	if (m) NEXT_HOOK(free_batch)(down, m, caller);
+}
+
+/* Every slot is SLAB_CLASS_SIZE-aligned. */
+void *OUR_HOOK(memalign)(size_t alignment, size_t size, const void *caller)
+{
+	if (alignment <= SLAB_CLASS_SIZE && size <= SLAB_MAX_SIZE)
+	{
+		unsigned i = class_for_request(size);
+		void *chunk = slab_alloc(i);
+		if (chunk) return chunk;
+		size = class_size(i);
+	}
+	return NEXT_HOOK(memalign)(alignment, size, caller);
+}
+
+size_t OUR_HOOK(malloc_usable_size)(void *ptr)
+{
+	if (is_ours(ptr)) return chunk_size(ptr);
+	return NEXT_HOOK(malloc_usable_size)(ptr);
+}
+
+/* Even from below, a small chunk is as big as its class. */
+size_t OUR_HOOK(good_size)(size_t size, size_t alignment, const void *caller)
+{
+	if (alignment <= SLAB_CLASS_SIZE && size <= SLAB_MAX_SIZE) return class_size(class_for_request(size));
+	return NEXT_HOOK(good_size)(size, alignment, caller);
+}
@@ -0,0 +1,200 @@
+/* A hook that keeps a small per-thread cache of recently freed chunks,
+ * by size class, and serves small mallocs from it without calling on
+ * down the chain (so, normally, without taking the allocator's lock).
+ *
+ * Small mallocs are rounded up to their class's size before we pass them
+ * on, so that any chunk we cache can serve any request in its class. On
+ * free we put a chunk in the largest class no bigger than its usable size;
+ * for a sized free, the caller's size is a lower bound on that, so we can
+ * skip the usable-size query. Other calls pass straight through.
+ *
+ * A thread's cache is flushed down the chain when it exits; anything the
+ * thread frees after that is passed through. We never hold a lock or touch
+ * another thread's cache, so re-entry from below (e.g. terminal-indirect-
+ * dlsym's dlsym allocating) is harmless. */
+
+#include <stdint.h>
+#include <pthread.h>
+
+#ifndef OUR_HOOK
+#define OUR_HOOK(m) hook_ ## m
+#endif
+#ifndef NEXT_HOOK
+#define NEXT_HOOK(m) __terminal_hook_ ## m
+#endif
+
+/* Prototype the hooks we call... */
+#define HOOK_PREFIX(m) NEXT_HOOK(m)
+#include "mallochooks/hookapi.h"
+#undef HOOK_PREFIX
+/* ... and the ones we define. */
+#define HOOK_PREFIX(m) OUR_HOOK(m)
+#include "mallochooks/hookapi.h"
+#undef HOOK_PREFIX
+
+#ifndef TCACHE_CLASS_SIZE
+#define TCACHE_CLASS_SIZE 16
+#endif
+#ifndef TCACHE_MAX_SIZE
+#define TCACHE_MAX_SIZE 512 /* a multiple of TCACHE_CLASS_SIZE */
+#endif
+#ifndef TCACHE_COUNT
+#define TCACHE_COUNT 32 /* chunks per class per thread */
+#endif
+#define TCACHE_NCLASSES (TCACHE_MAX_SIZE / TCACHE_CLASS_SIZE)
+
+struct tcache
+{
+	void *heads[TCACHE_NCLASSES];
+	unsigned counts[TCACHE_NCLASSES];
+	_Bool registered;
+	_Bool disabled;
+};
+/* Initial-exec, for the same reason as in terminal-indirect-dlsym.c. */
+static __thread struct tcache tcache __attribute__((tls_model("initial-exec")));
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+/* Class i holds chunks of at least (i+1) * TCACHE_CLASS_SIZE bytes. */
+static inline unsigned class_for_request(size_t size)
+{
+	return size ? (size - 1) / TCACHE_CLASS_SIZE : 0;
+}
+static inline size_t class_size(unsigned i)
+{
+	return (size_t) (i + 1) * TCACHE_CLASS_SIZE;
+}
+
+static void tcache_flush(void *arg)
+{
+	tcache.disabled = 1;
+	for (unsigned i = 0; i < TCACHE_NCLASSES; ++i)
+	{
+		while (tcache.heads[i])
+		{
+			void *chunk = tcache.heads[i];
+			tcache.heads[i] = *(void **) chunk;
+			NEXT_HOOK(free)(chunk, NULL);
+		}
+		tcache.counts[i] = 0;
+	}
+}
+
+static void tcache_make_key(void)
+{
+	pthread_key_create(&tcache_key, tcache_flush);
+}
+
+/* Arrange to flush at thread exit. pthread_setspecific may itself
+ * allocate, so mark ourselves registered first. */
+static void tcache_register(void)
+{
+	tcache.registered = 1;
+	pthread_once(&tcache_key_once, tcache_make_key);
+	pthread_setspecific(tcache_key, &tcache);
+}
+
+/* Returns nonzero if we kept the chunk. */
+static inline _Bool tcache_put(void *ptr, unsigned i)
+{
+	if (tcache.counts[i] >= TCACHE_COUNT || tcache.disabled) return 0;
+	if (__builtin_expect(!tcache.registered, 0)) tcache_register();
+	*(void **) ptr = tcache.heads[i];
+	tcache.heads[i] = ptr;
+	++tcache.counts[i];
+	return 1;
+}
+
+void OUR_HOOK(init)(void)
+{
+	NEXT_HOOK(init)();
+}
+
+void *OUR_HOOK(malloc)(size_t size, const void *caller)
+{
+	if (size > TCACHE_MAX_SIZE) return NEXT_HOOK(malloc)(size, caller);
+	unsigned i = class_for_request(size);
+	void *chunk = tcache.heads[i];
+	if (chunk)
+	{
+		tcache.heads[i] = *(void **) chunk;
+		--tcache.counts[i];
+		return chunk;
+	}
+	return NEXT_HOOK(malloc)(class_size(i), caller);
+}
+
+/* Zeroing is the allocator's business, so calloc bypasses the cache;
+ * but round the size, so that the chunk can be cached once freed. */
+void *OUR_HOOK(calloc)(size_t nmemb, size_t size, const void *caller)
+{
+	size_t total;
+	if (!__builtin_mul_overflow(nmemb, size, &total) && total <= TCACHE_MAX_SIZE)
+	{
+		return NEXT_HOOK(calloc)(1, class_size(class_for_request(total)), caller);
+	}
+	return NEXT_HOOK(calloc)(nmemb, size, caller);
+}
+
+void OUR_HOOK(free)(void *ptr, const void *caller)
+{
+	if (ptr)
+	{
+		size_t usable = NEXT_HOOK(malloc_usable_size)(ptr);
+		if (usable >= TCACHE_CLASS_SIZE)
+		{
+			unsigned i = usable / TCACHE_CLASS_SIZE - 1;
+			if (i < TCACHE_NCLASSES && tcache_put(ptr, i)) return;
+		}
+	}
+	NEXT_HOOK(free)(ptr, caller);
+}
+
+void OUR_HOOK(free_sized)(void *ptr, size_t size, const void *caller)
+{
+	if (ptr && size >= TCACHE_CLASS_SIZE)
+	{
+		unsigned i = size / TCACHE_CLASS_SIZE - 1;
+		if (i < TCACHE_NCLASSES && tcache_put(ptr, i)) return;
+	}
+	NEXT_HOOK(free_sized)(ptr, size, caller);
+}
+
+void *OUR_HOOK(realloc)(void *ptr, size_t size, const void *caller)
+{
+	return NEXT_HOOK(realloc)(ptr, size, caller);
+}
+
+void *OUR_HOOK(realloc_in_place)(void *ptr, size_t size, const void *caller)
+{
+	return NEXT_HOOK(realloc_in_place)(ptr, size, caller);
+}
+
+/* Batches go straight down, since the allocator can do them in bulk. */
+void **OUR_HOOK(malloc_batch)(size_t n, const size_t *sizes, void **out, const void *caller)
+{
+	return NEXT_HOOK(malloc_batch)(n, sizes, out, caller);
+}
+
+void OUR_HOOK(free_batch)(void *const *ptrs, size_t n, const void *caller)
+{
+	NEXT_HOOK(free_batch)(ptrs, n, caller);
+}
+
+void *OUR_HOOK(memalign)(size_t alignment, size_t size, const void *caller)
+{
+	return NEXT_HOOK(memalign)(alignment, size, caller);
+}
+
+size_t OUR_HOOK(malloc_usable_size)(void *ptr)
+{
+	return NEXT_HOOK(malloc_usable_size)(ptr);
+}
+
+/* A small malloc may get a cached chunk, which we know only to be as big
+ * as its class. */
+size_t OUR_HOOK(good_size)(size_t size, size_t alignment, const void *caller)
+{
+	if (alignment || size > TCACHE_MAX_SIZE) return NEXT_HOOK(good_size)(size, alignment, caller);
+	return class_size(class_for_request(size));
+}
@@ -22,6 +22,7 @@
 #define MALLOC_PREFIX(x) __real_ ## x
 #endif
 #include "mallochooks/userapi.h"
+#include "mallochooks/goodsize.h"
 
 void OUR_HOOK(init)(void) __attribute__((visibility("hidden")));
 void OUR_HOOK(init)(void) {}
@@ -31,16 +32,90 @@ void * OUR_HOOK(malloc)(size_t size, const void *caller)
 {
 	return MALLOC_PREFIX(malloc)(size);
 }
+void * OUR_HOOK(calloc)(size_t nmemb, size_t size, const void *caller) __attribute__((visibility("hidden")));
+void * OUR_HOOK(calloc)(size_t nmemb, size_t size, const void *caller)
+{
+	return MALLOC_PREFIX(calloc)(nmemb, size);
+}
 void OUR_HOOK(free)(void *ptr, const void *caller) __attribute__((visibility("hidden")));
 void OUR_HOOK(free)(void *ptr, const void *caller)
 {
 	MALLOC_PREFIX(free)(ptr);
 }
+void OUR_HOOK(free_sized)(void *ptr, size_t size, const void *caller) __attribute__((visibility("hidden")));
+void OUR_HOOK(free_sized)(void *ptr, size_t size, const void *caller)
+{
+	/* Only some mallocs have a sized free; dlmalloc does not. */
+#ifdef MALLOC_HAS_FREE_SIZED
+	MALLOC_PREFIX(free_sized)(ptr, size);
+#else
+	MALLOC_PREFIX(free)(ptr);
+#endif
+}
 void * OUR_HOOK(realloc)(void *ptr, size_t size, const void *caller) __attribute__((visibility("hidden")));
 void * OUR_HOOK(realloc)(void *ptr, size_t size, const void *caller)
 {
 	return MALLOC_PREFIX(realloc)(ptr, size);
 }
+void * OUR_HOOK(realloc_in_place)(void *ptr, size_t size, const void *caller) __attribute__((visibility("hidden")));
+void * OUR_HOOK(realloc_in_place)(void *ptr, size_t size, const void *caller)
+{
+	/* dlmalloc has one; otherwise we can only use the chunk's slack. */
+#ifdef MALLOC_HAS_REALLOC_IN_PLACE
+	return MALLOC_PREFIX(realloc_in_place)(ptr, size);
+#else
+	return ptr && MALLOC_PREFIX(malloc_usable_size)(ptr) >= size ? ptr : NULL;
+#endif
+}
+/* dlmalloc can allocate and free many chunks under one lock; define
+ * MALLOC_HAS_BULK_ALLOC to use its independent_comalloc and bulk_free.
+ * We don't hook those, so they keep their own names, by default plain. */
+#ifdef MALLOC_HAS_BULK_ALLOC
+#ifndef MALLOC_BULK_PREFIX
+#define MALLOC_BULK_PREFIX(m) m
+#endif
+void **MALLOC_BULK_PREFIX(independent_comalloc)(size_t n, size_t *sizes, void **chunks);
+size_t MALLOC_BULK_PREFIX(bulk_free)(void **array, size_t n);
+#define BULK_FREE_GROUP 64
+#endif
+void ** OUR_HOOK(malloc_batch)(size_t n, const size_t *sizes, void **out, const void *caller) __attribute__((visibility("hidden")));
+void ** OUR_HOOK(malloc_batch)(size_t n, const size_t *sizes, void **out, const void *caller)
+{
+#ifdef MALLOC_HAS_BULK_ALLOC
+	return MALLOC_BULK_PREFIX(independent_comalloc)(n, (size_t *) sizes, out);
+#else
+	for (size_t i = 0; i < n; ++i)
+	{
+		out[i] = MALLOC_PREFIX(malloc)(sizes[i]);
+		if (!out[i])
+		{
+			while (i > 0) MALLOC_PREFIX(free)(out[--i]);
+			return NULL;
+		}
+	}
+	return out;
+#endif
+}
+void OUR_HOOK(free_batch)(void *const *ptrs, size_t n, const void *caller) __attribute__((visibility("hidden")));
+void OUR_HOOK(free_batch)(void *const *ptrs, size_t n, const void *caller)
+{
+#ifdef MALLOC_HAS_BULK_ALLOC
+	/* bulk_free writes to its array, so give it a copy. */
+	void *group[BULK_FREE_GROUP];
+	for (size_t done = 0; done < n; done += BULK_FREE_GROUP)
+	{
+		size_t k = n - done < BULK_FREE_GROUP ? n - done : BULK_FREE_GROUP;
+		memcpy(group, ptrs + done, k * sizeof *group);
+		if (MALLOC_BULK_PREFIX(bulk_free)(group, k))
+		{
+			/* It leaves any it couldn't free (e.g. another mspace's). */
+			for (size_t i = 0; i < k; ++i) if (group[i]) MALLOC_PREFIX(free)(group[i]);
+		}
+	}
+#else
+	for (size_t i = 0; i < n; ++i) MALLOC_PREFIX(free)(ptrs[i]);
+#endif
+}
 void * OUR_HOOK(memalign)(size_t boundary, size_t size, const void *caller) __attribute__((visibility("hidden")));
 void * OUR_HOOK(memalign)(size_t boundary, size_t size, const void *caller)
 {
@@ -52,3 +127,19 @@ size_t OUR_HOOK(malloc_usable_size)(void *ptr)
 {
 	return MALLOC_PREFIX(malloc_usable_size)(ptr);
 }
+/* Define MALLOC_HAS_DLMALLOC_PADDING if malloc is dlmalloc (or glibc's),
+ * to work sizes out (with MALLOC_CHUNK_OVERHEAD of two words if dlmalloc
+ * has FOOTERS); otherwise we ask malloc. */
+#ifndef MALLOC_CHUNK_OVERHEAD
+#define MALLOC_CHUNK_OVERHEAD sizeof (size_t)
+#endif
+size_t OUR_HOOK(good_size)(size_t size, size_t alignment, const void *caller) __attribute__((visibility("hidden")));
+size_t OUR_HOOK(good_size)(size_t size, size_t alignment, const void *caller)
+{
+#ifdef MALLOC_HAS_DLMALLOC_PADDING
+	return mallochooks_dlmalloc_good_size(size, MALLOC_CHUNK_OVERHEAD);
+#else
+	return mallochooks_probe_good_size(size, alignment, MALLOC_PREFIX(malloc),
+		MALLOC_PREFIX(malloc_usable_size), MALLOC_PREFIX(free));
+#endif
+}
@@ -7,9 +7,11 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <sched.h>
 #include <link.h>
 #include <err.h>
 #include "relf.h"
+#include "mallochooks/goodsize.h"
 
 #include <errno.h>
 
@@ -17,8 +19,8 @@
  * with this (and some CPPFLAGS).
  *
  * Specifically, that file is just this one where
- * ABORT_ON_REENTRANCY is a no-op and
- * GET_UNDERLYING expands to a hidden extern prototype aliasing the real symname. */
+ * there is no bootstrap allocator and
+ * the underlying table is statically initialized with the real symnames. */
 
 #ifndef OUR_HOOK
 #define OUR_HOOK(m) __terminal_hook_ ## m
@@ -36,23 +38,23 @@
 
 /* Also prototype malloc itself if necessary. */
 
-/* NOTE that we can easily get infinite regress, so we guard against it 
- * explicitly. The caller/client must ensure we never get reentrant calls.
- * One way to do this is fake_dlsym() rather than dlsym. We assume this is
- * taken care of and the token 'dlsym' will get us a viable dlsym function.
- * 
- * (Yes, reentrant calls really need to be an error. There's no way to
- * guarantee that a reentrant malloc isn't paired with a non-reentrant
- * free, or vice-versa. In liballocs, with early_malloc we used to get
- * around this because we could dynamically identify early_malloc's chunks,
- * but how do you know how much space your early malloc pool needs? We then
- * got bugs where a special private malloc exhausted its initial arena and
- * suddenly we didn't recognise its newly mmap'd chunks. Nightmare....)
+/* NOTE that we can easily get infinite regress, e.g. if the dlsym we
+ * use to find the underlying malloc itself calls malloc, or if a calloc
+ * that gets hooked ends up calling malloc. (Reentering the underlying
+ * malloc is no good either: we'll hang re-acquiring glibc malloc's
+ * non-recursive arena mutex.) So we note, in a single flag, when we are
+ * active on a thread, and serve any call that arrives while it is set
+ * from a bootstrap allocator (bootstrap.inc.c).
  *
- * To detect reentrancy, we share a single flag. This is because,
- * say, a calloc that gets hooked might end up calling malloc. We
- * still don't want reentrancy (e.g. we'll hang re-acquiring glibc
- * malloc's non-recursive arena mutex). 
+ * There's no way to guarantee that a reentrant malloc isn't paired with
+ * a non-reentrant free, or vice-versa. In liballocs, with early_malloc we
+ * used to get around this because we could dynamically identify
+ * early_malloc's chunks, but how do you know how much space your early
+ * malloc pool needs? We then got bugs where a special private malloc
+ * exhausted its initial arena and suddenly we didn't recognise its newly
+ * mmap'd chunks. Nightmare.... The bootstrap allocator avoids that by
+ * never allocating outside one big reserved range, so free, realloc and
+ * malloc_usable_size can recognise its chunks with a range check.
  */
 
  /* This guard MUST use the initial-exec TLS model. With the default
@@ -68,10 +70,7 @@
 // HACK: This needs to be a hidden global and not a static to work around a gold bug
 __attribute__((visibility("hidden"), tls_model("initial-exec")))
 __thread _Bool we_are_active;
-#define ABORT_ON_REENTRANCY do { \
-	_Bool is_reentrant_call = we_are_active; \
-	if (is_reentrant_call) abort(); \
-	} while (0)
+#include "bootstrap.inc.c"
 #ifndef dlsym_nomalloc
 #warning "Expected a macro definition for dlsym_nomalloc, but continuing..."
 #endif
@@ -81,60 +80,370 @@ __thread _Bool we_are_active;
 #ifndef MALLOC_DLSYM_TARGET
 #define MALLOC_DLSYM_TARGET RTLD_NEXT
 #endif
-#define GET_UNDERLYING(ret_t, m, argts...) \
-	static ret_t (*underlying_ ## m )( argts ); \
-	if (!underlying_ ## m) underlying_ ## m = dlsym_nomalloc(MALLOC_DLSYM_TARGET, stringifx(MALLOC_PREFIX(m)) ); \
-	if (!underlying_ ## m  || underlying_ ## m == (void*)-1) abort();
 
-HIDDEN
-void __terminal_hook_init(void) {}
+/* We look up all the underlying functions at once, the first time any of
+ * them is needed (or from our constructor, whichever is sooner), into a
+ * table that is never written again. Until then, each entry points at a
+ * stub that does the lookup and calls on through the table, so that the
+ * steady-state path is just an indirect call -- no test, and no touching
+ * we_are_active. The lookup itself sets we_are_active, so the stubs
+ * send anything it allocates to the bootstrap allocator. Define
+ * MALLOC_CHECK_REENTRANCY to set it on every call too, e.g. to survive
+ * an underlying malloc that calls back into malloc. */
+struct underlying
+{
+	void *(*malloc)(size_t);
+	void *(*calloc)(size_t, size_t);
+	void (*free)(void*);
+	void (*free_sized)(void*, size_t);
+	void *(*realloc)(void*, size_t);
+	void *(*realloc_in_place)(void*, size_t);
+	void *(*memalign)(size_t, size_t);
+	size_t (*malloc_usable_size)(void*);
+	void **(*independent_comalloc)(size_t, size_t*, void**);
+	size_t (*bulk_free)(void**, size_t);
+};
+static void *resolve_then_malloc(size_t size);
+static void *resolve_then_calloc(size_t nmemb, size_t size);
+static void resolve_then_free(void *ptr);
+static void resolve_then_free_sized(void *ptr, size_t size);
+static void *resolve_then_realloc(void *ptr, size_t size);
+static void *resolve_then_realloc_in_place(void *ptr, size_t size);
+static void *resolve_then_memalign(size_t boundary, size_t size);
+static size_t resolve_then_malloc_usable_size(void *ptr);
+static void **resolve_then_independent_comalloc(size_t n, size_t *sizes, void **out);
+static size_t resolve_then_bulk_free(void **ptrs, size_t n);
+static struct underlying underlying = {
+	.malloc = resolve_then_malloc,
+	.calloc = resolve_then_calloc,
+	.free = resolve_then_free,
+	.free_sized = resolve_then_free_sized,
+	.realloc = resolve_then_realloc,
+	.realloc_in_place = resolve_then_realloc_in_place,
+	.memalign = resolve_then_memalign,
+	.malloc_usable_size = resolve_then_malloc_usable_size,
+	.independent_comalloc = resolve_then_independent_comalloc,
+	.bulk_free = resolve_then_bulk_free
+};
 
-HIDDEN
-void * __terminal_hook_malloc(size_t size, const void *caller)
+/* free_sized is C23, so the underlying malloc may not have it. */
+static void free_sized_via_free(void *ptr, size_t size)
+{
+	underlying.free(ptr);
+}
+/* So is realloc_in_place (dlmalloc has it, glibc does not); without it
+ * we can only use the chunk's slack. */
+static void *realloc_in_place_via_usable_size(void *ptr, size_t size)
 {
-	ABORT_ON_REENTRANCY;
+	return ptr && underlying.malloc_usable_size(ptr) >= size ? ptr : NULL;
+}
+/* Likewise dlmalloc's bulk calls, which we use for malloc_batch and
+ * free_batch; without them we go one chunk at a time. */
+static void **independent_comalloc_one_by_one(size_t n, size_t *sizes, void **out)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		out[i] = underlying.malloc(sizes[i]);
+		if (!out[i])
+		{
+			while (i > 0) underlying.free(out[--i]);
+			return NULL;
+		}
+	}
+	return out;
+}
+static size_t bulk_free_one_by_one(void **ptrs, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) underlying.free(ptrs[i]);
+	return 0;
+}
+
+#define LOOKUP_OPTIONAL(m) ({ \
+	void *sym_ = dlsym_nomalloc(MALLOC_DLSYM_TARGET, stringifx(MALLOC_PREFIX(m)) ); \
+	(sym_ == (void*)-1) ? NULL : sym_; })
+#define LOOKUP(m) ({ \
+	void *found_ = LOOKUP_OPTIONAL(m); \
+	if (!found_) abort(); \
+	found_; })
+enum { UNRESOLVED, RESOLVING, RESOLVED };
+static int resolution_state;
+static void resolve_underlying(void)
+{
+	int state = UNRESOLVED;
+	if (!__atomic_compare_exchange_n(&resolution_state, &state, RESOLVING,
+			0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+	{
+		/* Someone else got here first. (Not us: the stubs check.) The
+		 * lookups may take a while, so don't hog the CPU meanwhile. */
+		while (__atomic_load_n(&resolution_state, __ATOMIC_ACQUIRE) != RESOLVED) sched_yield();
+		return;
+	}
 	we_are_active = 1;
-	GET_UNDERLYING(void*, malloc, size_t);
-	void *ret = underlying_malloc(size);
+	struct underlying found = {
+		.malloc = LOOKUP(malloc),
+		.calloc = LOOKUP(calloc),
+		.free = LOOKUP(free),
+		.free_sized = LOOKUP_OPTIONAL(free_sized),
+		.realloc = LOOKUP(realloc),
+		.memalign = LOOKUP(memalign),
+		.malloc_usable_size = LOOKUP(malloc_usable_size),
+		/* These names are generic enough that some unrelated library may
+		 * define them, with other signatures, so we look for them only if
+		 * told (as for terminal-direct.c) that the malloc has them. */
+#ifdef MALLOC_HAS_REALLOC_IN_PLACE
+		.realloc_in_place = LOOKUP_OPTIONAL(realloc_in_place),
+#endif
+#ifdef MALLOC_HAS_BULK_ALLOC
+		.independent_comalloc = LOOKUP_OPTIONAL(independent_comalloc),
+		.bulk_free = LOOKUP_OPTIONAL(bulk_free)
+#endif
+	};
+	if (!found.free_sized) found.free_sized = free_sized_via_free;
+	if (!found.realloc_in_place) found.realloc_in_place = realloc_in_place_via_usable_size;
+	/* Use both of the bulk calls, or neither. */
+	if (!found.independent_comalloc || !found.bulk_free)
+	{
+		found.independent_comalloc = independent_comalloc_one_by_one;
+		found.bulk_free = bulk_free_one_by_one;
+	}
+	/* Other threads may be calling through the stubs meanwhile, so write
+	 * each entry as a whole. */
+#define PUBLISH(m) __atomic_store_n(&underlying.m, found.m, __ATOMIC_RELAXED);
+	PUBLISH(malloc)
+	PUBLISH(calloc)
+	PUBLISH(free)
+	PUBLISH(free_sized)
+	PUBLISH(realloc)
+	PUBLISH(realloc_in_place)
+	PUBLISH(memalign)
+	PUBLISH(malloc_usable_size)
+	PUBLISH(independent_comalloc)
+	PUBLISH(bulk_free)
+#undef PUBLISH
 	we_are_active = 0;
+	__atomic_store_n(&resolution_state, RESOLVED, __ATOMIC_RELEASE);
+}
+/* As one of terminal-select.c's backends, we resolve early only if we are
+ * the one chosen, when it calls our init. */
+#ifndef TERMINAL_SELECT_BACKEND
+__attribute__((constructor))
+#endif
+static void resolve_underlying_early(void)
+{
+	if (__atomic_load_n(&resolution_state, __ATOMIC_ACQUIRE) != RESOLVED) resolve_underlying();
+}
+
+static void *resolve_then_malloc(size_t size)
+{
+	if (we_are_active) return bootstrap_malloc(size);
+	resolve_underlying(); return underlying.malloc(size);
+}
+static void *resolve_then_calloc(size_t nmemb, size_t size)
+{
+	if (we_are_active) return bootstrap_calloc(nmemb, size);
+	resolve_underlying(); return underlying.calloc(nmemb, size);
+}
+/* Until we've resolved, every chunk of ours is a bootstrap chunk, and
+ * those never get this far. But dlsym may free a buffer that it got
+ * before we were around (its error string, after a failed optional
+ * lookup); we can only leak that. */
+static void resolve_then_free(void *ptr)
+{
+	if (we_are_active) return;
+	resolve_underlying(); underlying.free(ptr);
+}
+static void resolve_then_free_sized(void *ptr, size_t size)
+{
+	if (we_are_active) return;
+	resolve_underlying(); underlying.free_sized(ptr, size);
+}
+static void *resolve_then_realloc(void *ptr, size_t size)
+{
+	if (we_are_active) return bootstrap_malloc(size); /* ptr is NULL */
+	resolve_underlying(); return underlying.realloc(ptr, size);
+}
+/* Likewise, a chunk we see while resolving is not ours, so we can't
+ * resize it, nor say how big it is, nor free it. */
+static void *resolve_then_realloc_in_place(void *ptr, size_t size)
+{
+	if (we_are_active) return NULL;
+	resolve_underlying(); return underlying.realloc_in_place(ptr, size);
+}
+static void *resolve_then_memalign(size_t boundary, size_t size)
+{
+	if (we_are_active) return bootstrap_memalign(boundary, size);
+	resolve_underlying(); return underlying.memalign(boundary, size);
+}
+static size_t resolve_then_malloc_usable_size(void *ptr)
+{
+	if (we_are_active) return 0;
+	resolve_underlying(); return underlying.malloc_usable_size(ptr);
+}
+static void **resolve_then_independent_comalloc(size_t n, size_t *sizes, void **out)
+{
+	if (we_are_active) return NULL; /* OUR_HOOK(malloc_batch) will go one by one */
+	resolve_underlying(); return underlying.independent_comalloc(n, sizes, out);
+}
+static size_t resolve_then_bulk_free(void **ptrs, size_t n)
+{
+	if (we_are_active) return 0; /* leaked, as for free */
+	resolve_underlying(); return underlying.bulk_free(ptrs, n);
+}
+
+#ifdef MALLOC_CHECK_REENTRANCY
+#define ENTER(on_reentry) do { if (we_are_active) { on_reentry; } we_are_active = 1; } while (0)
+#define LEAVE (we_are_active = 0)
+#else
+#define ENTER(on_reentry) ((void)0)
+#define LEAVE ((void)0)
+#endif
+
+#ifdef MALLOC_CHECK_REENTRANCY
+/* A chunk of the underlying malloc's, reallocated from within it. We must
+ * not call down again to free it, so it leaks. */
+static void *realloc_reentrant(void *ptr, size_t size)
+{
+	void *new_ptr = bootstrap_malloc(size);
+	if (new_ptr && ptr)
+	{
+		size_t old_size = underlying.malloc_usable_size(ptr);
+		memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+	}
+	return new_ptr;
+}
+#endif
+
+HIDDEN
+void OUR_HOOK(init)(void)
+{
+	resolve_underlying_early();
+}
+
+HIDDEN
+void * OUR_HOOK(malloc)(size_t size, const void *caller)
+{
+	ENTER(return bootstrap_malloc(size));
+	void *ret = underlying.malloc(size);
+	LEAVE;
 	return ret;
 }
 HIDDEN
-void __terminal_hook_free(void *ptr, const void *caller)
+void * OUR_HOOK(calloc)(size_t nmemb, size_t size, const void *caller)
 {
-	ABORT_ON_REENTRANCY;
-	we_are_active = 1;
-	GET_UNDERLYING(void, free, void*);
-	we_are_active = 0;
-	underlying_free(ptr);
+	ENTER(return bootstrap_calloc(nmemb, size));
+	void *ret = underlying.calloc(nmemb, size);
+	LEAVE;
+	return ret;
 }
 HIDDEN
-void * __terminal_hook_realloc(void *ptr, size_t size, const void *caller)
+void OUR_HOOK(free)(void *ptr, const void *caller)
 {
-	ABORT_ON_REENTRANCY;
-	we_are_active = 1;
-	GET_UNDERLYING(void*, realloc, void*, size_t);
-	void *ret = underlying_realloc(ptr, size);
-	we_are_active = 0;
+	if (is_bootstrap_chunk(ptr)) return;
+	underlying.free(ptr);
+}
+HIDDEN
+void OUR_HOOK(free_sized)(void *ptr, size_t size, const void *caller)
+{
+	if (is_bootstrap_chunk(ptr)) return;
+	underlying.free_sized(ptr, size);
+}
+HIDDEN
+void * OUR_HOOK(realloc)(void *ptr, size_t size, const void *caller)
+{
+	if (is_bootstrap_chunk(ptr))
+	{
+		return bootstrap_realloc(ptr, size,
+			we_are_active ? bootstrap_malloc : underlying.malloc);
+	}
+	ENTER(return realloc_reentrant(ptr, size));
+	void *ret = underlying.realloc(ptr, size);
+	LEAVE;
 	return ret;
 }
 HIDDEN
-void * __terminal_hook_memalign(size_t boundary, size_t size, const void *caller)
+void * OUR_HOOK(realloc_in_place)(void *ptr, size_t size, const void *caller)
 {
-	ABORT_ON_REENTRANCY;
-	we_are_active = 1;
-	GET_UNDERLYING(void*, memalign, size_t, size_t);
-	void *ret = underlying_memalign(boundary, size);
-	we_are_active = 0;
+	if (is_bootstrap_chunk(ptr)) return bootstrap_usable_size(ptr) >= size ? ptr : NULL;
+	ENTER(return NULL);
+	void *ret = underlying.realloc_in_place(ptr, size);
+	LEAVE;
 	return ret;
 }
+/* A batch is all or nothing, so from within the underlying malloc, or if
+ * the bulk call fails (perhaps only because we_are_active), we go one by
+ * one; that way we can fall back to the bootstrap allocator. */
 HIDDEN
-size_t __terminal_hook_malloc_usable_size(void * ptr)
+void ** OUR_HOOK(malloc_batch)(size_t n, const size_t *sizes, void **out, const void *caller)
 {
-	ABORT_ON_REENTRANCY;
-	we_are_active = 1;
-	GET_UNDERLYING(size_t, malloc_usable_size, void*);
-	size_t ret = underlying_malloc_usable_size(ptr);
-	we_are_active = 0;
+	ENTER(goto one_by_one);
+	void **ret = underlying.independent_comalloc(n, (size_t *) sizes, out);
+	LEAVE;
+	if (ret) return ret;
+#ifdef MALLOC_CHECK_REENTRANCY
+one_by_one:
+#endif
+	for (size_t i = 0; i < n; ++i)
+	{
+		out[i] = OUR_HOOK(malloc)(sizes[i], caller);
+		if (!out[i])
+		{
+			while (i > 0) OUR_HOOK(free)(out[--i], caller);
+			return NULL;
+		}
+	}
+	return out;
+}
+#define BULK_FREE_GROUP 64
+static void bulk_free_group(void **group, size_t k)
+{
+	/* It leaves any it couldn't free (e.g. another mspace's). */
+	if (underlying.bulk_free(group, k))
+	{
+		for (size_t j = 0; j < k; ++j) if (group[j]) underlying.free(group[j]);
+	}
+}
+HIDDEN
+void OUR_HOOK(free_batch)(void *const *ptrs, size_t n, const void *caller)
+{
+	/* bulk_free writes to its array, so give it a copy, less any
+	 * bootstrap chunks. */
+	void *group[BULK_FREE_GROUP];
+	size_t k = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (!ptrs[i] || is_bootstrap_chunk(ptrs[i])) continue;
+		group[k++] = ptrs[i];
+		if (k == BULK_FREE_GROUP)
+		{
+			bulk_free_group(group, k);
+			k = 0;
+		}
+	}
+	if (k) bulk_free_group(group, k);
+}
+HIDDEN
+void * OUR_HOOK(memalign)(size_t boundary, size_t size, const void *caller)
+{
+	ENTER(return bootstrap_memalign(boundary, size));
+	void *ret = underlying.memalign(boundary, size);
+	LEAVE;
+	return ret;
+}
+HIDDEN
+size_t OUR_HOOK(malloc_usable_size)(void * ptr)
+{
+	if (is_bootstrap_chunk(ptr)) return bootstrap_usable_size(ptr);
+	return underlying.malloc_usable_size(ptr);
+}
+/* We don't know which malloc we found, so we ask it; but not until we
+ * have found it, since until then we'd be asking the bootstrap allocator. */
+HIDDEN
+size_t OUR_HOOK(good_size)(size_t size, size_t alignment, const void *caller)
+{
+	if (__atomic_load_n(&resolution_state, __ATOMIC_ACQUIRE) != RESOLVED) return size;
+	ENTER(return size);
+	size_t ret = mallochooks_probe_good_size(size, alignment, underlying.malloc,
+		underlying.malloc_usable_size, underlying.free);
+	LEAVE;
 	return ret;
 }
@@ -0,0 +1,283 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <errno.h>
+
+/* A terminal that gives each thread its own dlmalloc mspace, so that
+ * threads never contend for an allocator lock.
+ *
+ * This needs contrib/dlmalloc.c built with -DMSPACES=1 -DFOOTERS=1
+ * (it need not use locks). FOOTERS lets us find the mspace that owns any
+ * chunk (mspace_of()). A thread frees its own chunks directly; a chunk
+ * owned by another thread is pushed onto its owner's lock-free remote-free
+ * list (remote-free.inc.c), which the owner drains, with mspace_bulk_free,
+ * on its next allocation. Only the owner ever
+ * touches an mspace's internals, so a realloc of another thread's chunk
+ * becomes malloc + copy + remote free.
+ *
+ * Each mspace lives in an mmap'd region whose first page starts with our
+ * 'struct tl_space', followed by the mspace's own bookkeeping, so we can
+ * get from an mspace back to our struct by rounding down to the page.
+ * When a thread exits, its mspace is abandoned (with its chunks still
+ * live), and the next new thread adopts it. */
+
+#ifndef OUR_HOOK
+#define OUR_HOOK(m) __terminal_hook_ ## m
+#endif
+
+/* Prototype the __terminal_hook_* functions. */
+#define HOOK_PREFIX(i) OUR_HOOK(i)
+#include "mallochooks/hookapi.h"
+#include "mallochooks/goodsize.h"
+#include "remote-free.inc.c"
+
+/* The parts of dlmalloc's mspace API we use. */
+typedef void *mspace;
+mspace create_mspace_with_base(void *base, size_t capacity, int locked);
+void *mspace_malloc(mspace msp, size_t bytes);
+void *mspace_calloc(mspace msp, size_t n_elements, size_t elem_size);
+void *mspace_realloc(mspace msp, void *mem, size_t newsize);
+void *mspace_realloc_in_place(mspace msp, void *mem, size_t newsize);
+void *mspace_memalign(mspace msp, size_t alignment, size_t bytes);
+void **mspace_independent_comalloc(mspace msp, size_t n_elements, size_t sizes[], void *chunks[]);
+size_t mspace_bulk_free(mspace msp, void *array[], size_t nelem);
+void mspace_free(mspace msp, void *mem);
+size_t mspace_usable_size(const void *mem);
+mspace mspace_of(const void *mem);
+
+#ifndef TL_MSPACE_INITIAL
+#define TL_MSPACE_INITIAL (1ul<<20) /* first region per thread; more comes from mmap */
+#endif
+#define TL_MSPACE_PAGE 4096
+
+enum tl_space_state { TL_SPACE_OWNED = 1, TL_SPACE_ABANDONED };
+struct tl_space
+{
+	mspace msp;
+	int state;
+	struct tl_space *next; /* all spaces ever made; never unlinked */
+	/* Chunks freed by other threads. */
+	_Alignas(64) struct remote_frees remote_frees;
+};
+
+static struct tl_space *spaces;
+static pthread_key_t space_key;
+static pthread_once_t space_key_once = PTHREAD_ONCE_INIT;
+/* Initial-exec, for the same reason as in terminal-indirect-dlsym.c. */
+static __thread struct tl_space *my_space __attribute__((tls_model("initial-exec")));
+
+static inline struct tl_space *space_of_mspace(mspace msp)
+{
+	return (struct tl_space *) ((uintptr_t) msp & ~(uintptr_t) (TL_MSPACE_PAGE - 1));
+}
+
+static void space_abandon(void *arg)
+{
+	struct tl_space *space = arg;
+	my_space = NULL;
+	__atomic_store_n(&space->state, TL_SPACE_ABANDONED, __ATOMIC_RELEASE);
+}
+
+static void space_make_key(void)
+{
+	pthread_key_create(&space_key, space_abandon);
+}
+
+static struct tl_space *space_new(void)
+{
+	struct tl_space *space;
+	for (space = __atomic_load_n(&spaces, __ATOMIC_ACQUIRE); space; space = space->next)
+	{
+		int state = TL_SPACE_ABANDONED;
+		if (__atomic_compare_exchange_n(&space->state, &state, TL_SPACE_OWNED,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return space;
+	}
+	char *region = mmap(NULL, TL_MSPACE_INITIAL, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED) return NULL;
+	space = (struct tl_space *) region;
+	size_t header = (sizeof (struct tl_space) + 63) & ~(size_t) 63;
+	space->msp = create_mspace_with_base(region + header, TL_MSPACE_INITIAL - header, 0);
+	if (!space->msp) { munmap(region, TL_MSPACE_INITIAL); return NULL; }
+	assert(space_of_mspace(space->msp) == space);
+	space->state = TL_SPACE_OWNED;
+	space->next = __atomic_load_n(&spaces, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&spaces, &space->next, space,
+			1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return space;
+}
+
+static struct tl_space *space_get_slow(void)
+{
+	struct tl_space *space = space_new();
+	if (!space) return NULL;
+	/* Set this before pthread_setspecific, which may allocate. */
+	my_space = space;
+	pthread_once(&space_key_once, space_make_key);
+	pthread_setspecific(space_key, space);
+	return space;
+}
+
+static void space_release(void *msp, void **chunks, size_t n)
+{
+	mspace_bulk_free(msp, chunks, n);
+}
+static void space_drain(struct tl_space *space)
+{
+	remote_frees_drain(&space->remote_frees, space_release, space->msp);
+}
+
+/* Our thread's space, with any remote frees taken in. */
+static inline struct tl_space *space_get(void)
+{
+	struct tl_space *space = my_space;
+	if (__builtin_expect(!space, 0)) space = space_get_slow();
+	if (space && __builtin_expect(remote_frees_pending(&space->remote_frees), 0))
+	{
+		space_drain(space);
+	}
+	return space;
+}
+
+static void remote_free(struct tl_space *owner, void *ptr)
+{
+	remote_frees_push(&owner->remote_frees, ptr);
+}
+
+/* A chunk no mspace of ours owns (a wild pointer, a double free, someone
+ * else's chunk) would have us push onto whatever its footer points at, so
+ * we abort, as mspace_free would. dlmalloc's own global mspace passes
+ * mspace_of's test, so we also check that the owner is one of ours. */
+static inline mspace owner_of(void *ptr)
+{
+	mspace owner = mspace_of(ptr);
+	if (__builtin_expect(!owner || space_of_mspace(owner)->msp != owner, 0)) abort();
+	return owner;
+}
+
+void OUR_HOOK(init)(void) __attribute__((visibility("hidden")));
+void OUR_HOOK(init)(void) {}
+
+void * OUR_HOOK(malloc)(size_t size, const void *caller) __attribute__((visibility("hidden")));
+void * OUR_HOOK(malloc)(size_t size, const void *caller)
+{
+	struct tl_space *space = space_get();
+	if (!space) { errno = ENOMEM; return NULL; }
+	return mspace_malloc(space->msp, size);
+}
+void * OUR_HOOK(calloc)(size_t nmemb, size_t size, const void *caller) __attribute__((visibility("hidden")));
+void * OUR_HOOK(calloc)(size_t nmemb, size_t size, const void *caller)
+{
+	struct tl_space *space = space_get();
+	if (!space) { errno = ENOMEM; return NULL; }
+	return mspace_calloc(space->msp, nmemb, size);
+}
+void OUR_HOOK(free)(void *ptr, const void *caller) __attribute__((visibility("hidden")));
+void OUR_HOOK(free)(void *ptr, const void *caller)
+{
+	if (!ptr) return;
+	mspace owner = owner_of(ptr);
+	struct tl_space *mine = my_space;
+	if (mine && owner == mine->msp) mspace_free(owner, ptr);
+	else remote_free(space_of_mspace(owner), ptr);
+}
+void OUR_HOOK(free_sized)(void *ptr, size_t size, const void *caller) __attribute__((visibility("hidden")));
+void OUR_HOOK(free_sized)(void *ptr, size_t size, const void *caller)
+{
+	OUR_HOOK(free)(ptr, caller);
+}
+void * OUR_HOOK(realloc)(void *ptr, size_t size, const void *caller) __attribute__((visibility("hidden")));
+void * OUR_HOOK(realloc)(void *ptr, size_t size, const void *caller)
+{
+	if (!ptr) return OUR_HOOK(malloc)(size, caller);
+	if (size == 0) { OUR_HOOK(free)(ptr, caller); return NULL; }
+	struct tl_space *space = space_get();
+	if (!space) { errno = ENOMEM; return NULL; }
+	mspace owner = owner_of(ptr);
+	if (owner == space->msp) return mspace_realloc(owner, ptr, size);
+	/* Not ours, so we may not touch its mspace. */
+	void *new_ptr = mspace_malloc(space->msp, size);
+	if (!new_ptr) return NULL;
+	size_t old_size = mspace_usable_size(ptr);
+	memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+	remote_free(space_of_mspace(owner), ptr);
+	return new_ptr;
+}
+void * OUR_HOOK(realloc_in_place)(void *ptr, size_t size, const void *caller) __attribute__((visibility("hidden")));
+void * OUR_HOOK(realloc_in_place)(void *ptr, size_t size, const void *caller)
+{
+	if (!ptr) return NULL;
+	mspace owner = owner_of(ptr);
+	struct tl_space *mine = my_space;
+	if (mine && owner == mine->msp) return mspace_realloc_in_place(owner, ptr, size);
+	/* Not ours, so all we can use is the chunk's slack. */
+	return mspace_usable_size(ptr) >= size ? ptr : NULL;
+}
+void ** OUR_HOOK(malloc_batch)(size_t n, const size_t *sizes, void **out, const void *caller) __attribute__((visibility("hidden")));
+void ** OUR_HOOK(malloc_batch)(size_t n, const size_t *sizes, void **out, const void *caller)
+{
+	struct tl_space *space = space_get();
+	if (!space) { errno = ENOMEM; return NULL; }
+	return mspace_independent_comalloc(space->msp, n, (size_t *) sizes, out);
+}
+/* Our own chunks go to mspace_bulk_free (on a copy, since it writes to its
+ * array). Other threads' chunks are freed remotely, each run of chunks with
+ * the same owner as one chain, so with one compare-and-swap. */
+#define BULK_FREE_GROUP 64
+void OUR_HOOK(free_batch)(void *const *ptrs, size_t n, const void *caller) __attribute__((visibility("hidden")));
+void OUR_HOOK(free_batch)(void *const *ptrs, size_t n, const void *caller)
+{
+	struct tl_space *mine = my_space;
+	void *group[BULK_FREE_GROUP];
+	size_t k = 0;
+	mspace run_owner = NULL;
+	void *run_first = NULL, *run_last = NULL;
+	for (size_t i = 0; i < n; ++i)
+	{
+		void *ptr = ptrs[i];
+		if (!ptr) continue;
+		mspace owner = owner_of(ptr);
+		if (mine && owner == mine->msp)
+		{
+			group[k++] = ptr;
+			if (k == BULK_FREE_GROUP) { mspace_bulk_free(mine->msp, group, k); k = 0; }
+			continue;
+		}
+		if (run_first && owner == run_owner)
+		{
+			*(void **) run_last = ptr;
+			run_last = ptr;
+			continue;
+		}
+		if (run_first) remote_frees_push_chain(&space_of_mspace(run_owner)->remote_frees, run_first, run_last);
+		run_owner = owner;
+		run_first = run_last = ptr;
+	}
+	if (run_first) remote_frees_push_chain(&space_of_mspace(run_owner)->remote_frees, run_first, run_last);
+	if (k) mspace_bulk_free(mine->msp, group, k);
+}
+void * OUR_HOOK(memalign)(size_t boundary, size_t size, const void *caller) __attribute__((visibility("hidden")));
+void * OUR_HOOK(memalign)(size_t boundary, size_t size, const void *caller)
+{
+	struct tl_space *space = space_get();
+	if (!space) { errno = ENOMEM; return NULL; }
+	return mspace_memalign(space->msp, boundary, size);
+}
+
+size_t OUR_HOOK(malloc_usable_size)(void *ptr) __attribute__((visibility("hidden")));
+size_t OUR_HOOK(malloc_usable_size)(void *ptr)
+{
+	return mspace_usable_size(ptr);
+}
+/* FOOTERS makes each chunk's overhead two words. */
+size_t OUR_HOOK(good_size)(size_t size, size_t alignment, const void *caller) __attribute__((visibility("hidden")));
+size_t OUR_HOOK(good_size)(size_t size, size_t alignment, const void *caller)
+{
+	return mallochooks_dlmalloc_good_size(size, 2 * sizeof (size_t));
+}
@@ -0,0 +1,337 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+
+/* A terminal that passes everything on to one of several other terminals,
+ * all linked in alongside it, chosen at startup by the environment
+ * variable MALLOCHOOKS_TERMINAL (e.g. MALLOCHOOKS_TERMINAL=mspace), so the
+ * same binary can run on different allocators.
+ *
+ * Each backend is an ordinary terminal built with its own OUR_HOOK
+ * prefix, __terminal_<name>_hook_, and announced to us by defining
+ * TERMINAL_SELECT_HAVE_<name> (rules.mk does both, for each entry in
+ * MALLOCHOOKS_SELECT). A backend's name is its source file's, less
+ * 'terminal-' (direct, indirect-dlsym, mspace), with '_' for '-' in the
+ * macro. A backend may also be a hook, stacked over one of the terminals
+ * (slab, over the first terminal in MALLOCHOOKS_SELECT). Without the
+ * variable, or with a name we don't have, we use TERMINAL_SELECT_DEFAULT,
+ * or else the first backend we have.
+ *
+ * As in terminal-indirect-dlsym.c, the choice is made once, the first
+ * time any hook is called or from our constructor, into a table that is
+ * never written again, so the steady state is one indirect call. Choosing
+ * must not allocate: we read the environment directly, or
+ * /proc/self/environ if we are called before libc has set up 'environ'.
+ * Our constructor then inits the chosen backend, so that only it does any
+ * work at startup (a backend built with TERMINAL_SELECT_BACKEND leaves
+ * that to us). */
+
+#ifndef OUR_HOOK
+#define OUR_HOOK(m) __terminal_hook_ ## m
+#endif
+
+/* Prototype the __terminal_hook_* functions. */
+#define HOOK_PREFIX(i) OUR_HOOK(i)
+#include "mallochooks/hookapi.h"
+#undef HOOK_PREFIX
+
+/* ... and each backend's. */
+#ifdef TERMINAL_SELECT_HAVE_direct
+#define HOOK_PREFIX(i) __terminal_direct_hook_ ## i
+#include "mallochooks/hookapi.h"
+#undef HOOK_PREFIX
+#endif
+#ifdef TERMINAL_SELECT_HAVE_indirect_dlsym
+#define HOOK_PREFIX(i) __terminal_indirect_dlsym_hook_ ## i
+#include "mallochooks/hookapi.h"
+#undef HOOK_PREFIX
+#endif
+#ifdef TERMINAL_SELECT_HAVE_mspace
+#define HOOK_PREFIX(i) __terminal_mspace_hook_ ## i
+#include "mallochooks/hookapi.h"
+#undef HOOK_PREFIX
+#endif
+#ifdef TERMINAL_SELECT_HAVE_slab
+#define HOOK_PREFIX(i) __terminal_slab_hook_ ## i
+#include "mallochooks/hookapi.h"
+#undef HOOK_PREFIX
+#endif
+#if !defined(TERMINAL_SELECT_HAVE_direct) \
+ && !defined(TERMINAL_SELECT_HAVE_indirect_dlsym) \
+ && !defined(TERMINAL_SELECT_HAVE_mspace)
+#error "terminal-select needs at least one TERMINAL_SELECT_HAVE_<backend>"
+#endif
+
+struct backend
+{
+	const char *name;
+	void (*init)(void);
+	void *(*malloc)(size_t, const void *);
+	void *(*calloc)(size_t, size_t, const void *);
+	void (*free)(void *, const void *);
+	void (*free_sized)(void *, size_t, const void *);
+	void *(*realloc)(void *, size_t, const void *);
+	void *(*realloc_in_place)(void *, size_t, const void *);
+	void **(*malloc_batch)(size_t, const size_t *, void **, const void *);
+	void (*free_batch)(void *const *, size_t, const void *);
+	void *(*memalign)(size_t, size_t, const void *);
+	size_t (*malloc_usable_size)(void *);
+	size_t (*good_size)(size_t, size_t, const void *);
+};
+#define BACKEND(str, p) { .name = str, \
+	.init = p ## init, \
+	.malloc = p ## malloc, \
+	.calloc = p ## calloc, \
+	.free = p ## free, \
+	.free_sized = p ## free_sized, \
+	.realloc = p ## realloc, \
+	.realloc_in_place = p ## realloc_in_place, \
+	.malloc_batch = p ## malloc_batch, \
+	.free_batch = p ## free_batch, \
+	.memalign = p ## memalign, \
+	.malloc_usable_size = p ## malloc_usable_size, \
+	.good_size = p ## good_size }
+static const struct backend backends[] = {
+#ifdef TERMINAL_SELECT_HAVE_direct
+	BACKEND("direct", __terminal_direct_hook_),
+#endif
+#ifdef TERMINAL_SELECT_HAVE_indirect_dlsym
+	BACKEND("indirect-dlsym", __terminal_indirect_dlsym_hook_),
+#endif
+#ifdef TERMINAL_SELECT_HAVE_mspace
+	BACKEND("mspace", __terminal_mspace_hook_),
+#endif
+#ifdef TERMINAL_SELECT_HAVE_slab
+	BACKEND("slab", __terminal_slab_hook_),
+#endif
+};
+#undef BACKEND
+#define NBACKENDS (sizeof backends / sizeof backends[0])
+
+static void select_then_init(void);
+static void *select_then_malloc(size_t size, const void *caller);
+static void *select_then_calloc(size_t nmemb, size_t size, const void *caller);
+static void select_then_free(void *ptr, const void *caller);
+static void select_then_free_sized(void *ptr, size_t size, const void *caller);
+static void *select_then_realloc(void *ptr, size_t size, const void *caller);
+static void *select_then_realloc_in_place(void *ptr, size_t size, const void *caller);
+static void **select_then_malloc_batch(size_t n, const size_t *sizes, void **out, const void *caller);
+static void select_then_free_batch(void *const *ptrs, size_t n, const void *caller);
+static void *select_then_memalign(size_t alignment, size_t size, const void *caller);
+static size_t select_then_malloc_usable_size(void *ptr);
+static size_t select_then_good_size(size_t size, size_t alignment, const void *caller);
+static struct backend selected = {
+	.name = NULL,
+	.init = select_then_init,
+	.malloc = select_then_malloc,
+	.calloc = select_then_calloc,
+	.free = select_then_free,
+	.free_sized = select_then_free_sized,
+	.realloc = select_then_realloc,
+	.realloc_in_place = select_then_realloc_in_place,
+	.malloc_batch = select_then_malloc_batch,
+	.free_batch = select_then_free_batch,
+	.memalign = select_then_memalign,
+	.malloc_usable_size = select_then_malloc_usable_size,
+	.good_size = select_then_good_size
+};
+
+#define SELECT_VAR "MALLOCHOOKS_TERMINAL"
+extern char **environ;
+/* Find NAME=value in /proc/self/environ, reading it a block at a time. */
+static const char *proc_environ_lookup(const char *name)
+{
+	static char value[64];
+	char block[512];
+	size_t len = strlen(name), matched = 0, out = 0;
+	_Bool at_start = 1, capturing = 0;
+	int fd = open("/proc/self/environ", O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return NULL;
+	ssize_t n;
+	while ((n = read(fd, block, sizeof block)) > 0)
+	{
+		for (ssize_t i = 0; i < n; ++i)
+		{
+			char c = block[i];
+			if (capturing)
+			{
+				if (c == '\0' || out == sizeof value - 1) goto found;
+				value[out++] = c;
+			}
+			else if (c == '\0') { at_start = 1; matched = 0; }
+			else if (!at_start) continue;
+			else if (matched < len && c == name[matched]) ++matched;
+			else if (matched == len && c == '=') capturing = 1;
+			else at_start = 0;
+		}
+	}
+	if (!capturing) { close(fd); return NULL; }
+found:
+	close(fd);
+	value[out] = '\0';
+	return value;
+}
+static const char *environ_lookup(const char *name)
+{
+	if (!environ) return proc_environ_lookup(name);
+	size_t len = strlen(name);
+	for (char **p = environ; *p; ++p)
+	{
+		if (0 == strncmp(*p, name, len) && (*p)[len] == '=') return *p + len + 1;
+	}
+	return NULL;
+}
+static void warn_unknown(const char *value, const char *fallback)
+{
+	/* No stdio: it may allocate. */
+	static const char prefix[] = "libmallochooks: unknown " SELECT_VAR " '";
+	static const char middle[] = "'; using '";
+	static const char suffix[] = "'\n";
+	if (write(2, prefix, sizeof prefix - 1) == -1) return;
+	if (write(2, value, strlen(value)) == -1) return;
+	if (write(2, middle, sizeof middle - 1) == -1) return;
+	if (write(2, fallback, strlen(fallback)) == -1) return;
+	if (write(2, suffix, sizeof suffix - 1) == -1) return;
+}
+static const struct backend *backend_named(const char *name)
+{
+	for (unsigned i = 0; i < NBACKENDS; ++i)
+	{
+		if (0 == strcmp(backends[i].name, name)) return &backends[i];
+	}
+	return NULL;
+}
+static const struct backend *default_backend(void)
+{
+#ifdef TERMINAL_SELECT_DEFAULT
+	const struct backend *b = backend_named(TERMINAL_SELECT_DEFAULT);
+	if (b) return b;
+#endif
+	return &backends[0];
+}
+
+enum { UNSELECTED, SELECTING, SELECTED };
+static int selection_state;
+static void select_backend(void)
+{
+	int state = UNSELECTED;
+	if (!__atomic_compare_exchange_n(&selection_state, &state, SELECTING,
+			0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+	{
+		/* Someone else got here first. Choosing never allocates, so
+		 * it is not us. */
+		while (__atomic_load_n(&selection_state, __ATOMIC_ACQUIRE) != SELECTED) sched_yield();
+		return;
+	}
+	const char *value = environ_lookup(SELECT_VAR);
+	if (value && !*value) value = NULL;
+	const struct backend *b = value ? backend_named(value) : NULL;
+	if (!b)
+	{
+		b = default_backend();
+		if (value) warn_unknown(value, b->name);
+	}
+	/* Other threads may be calling through the stubs meanwhile, so write
+	 * each entry as a whole. */
+#define PUBLISH(m) __atomic_store_n(&selected.m, b->m, __ATOMIC_RELAXED);
+	PUBLISH(name)
+	PUBLISH(init)
+	PUBLISH(malloc)
+	PUBLISH(calloc)
+	PUBLISH(free)
+	PUBLISH(free_sized)
+	PUBLISH(realloc)
+	PUBLISH(realloc_in_place)
+	PUBLISH(malloc_batch)
+	PUBLISH(free_batch)
+	PUBLISH(memalign)
+	PUBLISH(malloc_usable_size)
+	PUBLISH(good_size)
+#undef PUBLISH
+	__atomic_store_n(&selection_state, SELECTED, __ATOMIC_RELEASE);
+}
+
+static void select_then_init(void)
+{ select_backend(); selected.init(); }
+static void *select_then_malloc(size_t size, const void *caller)
+{ select_backend(); return selected.malloc(size, caller); }
+static void *select_then_calloc(size_t nmemb, size_t size, const void *caller)
+{ select_backend(); return selected.calloc(nmemb, size, caller); }
+static void select_then_free(void *ptr, const void *caller)
+{ select_backend(); selected.free(ptr, caller); }
+static void select_then_free_sized(void *ptr, size_t size, const void *caller)
+{ select_backend(); selected.free_sized(ptr, size, caller); }
+static void *select_then_realloc(void *ptr, size_t size, const void *caller)
+{ select_backend(); return selected.realloc(ptr, size, caller); }
+static void *select_then_realloc_in_place(void *ptr, size_t size, const void *caller)
+{ select_backend(); return selected.realloc_in_place(ptr, size, caller); }
+static void **select_then_malloc_batch(size_t n, const size_t *sizes, void **out, const void *caller)
+{ select_backend(); return selected.malloc_batch(n, sizes, out, caller); }
+static void select_then_free_batch(void *const *ptrs, size_t n, const void *caller)
+{ select_backend(); selected.free_batch(ptrs, n, caller); }
+static void *select_then_memalign(size_t alignment, size_t size, const void *caller)
+{ select_backend(); return selected.memalign(alignment, size, caller); }
+static size_t select_then_malloc_usable_size(void *ptr)
+{ select_backend(); return selected.malloc_usable_size(ptr); }
+static size_t select_then_good_size(size_t size, size_t alignment, const void *caller)
+{ select_backend(); return selected.good_size(size, alignment, caller); }
+
+__attribute__((constructor))
+static void select_early(void)
+{
+	if (__atomic_load_n(&selection_state, __ATOMIC_ACQUIRE) != SELECTED) select_backend();
+	selected.init();
+}
+
+void OUR_HOOK(init)(void)
+{
+	selected.init();
+}
+void * OUR_HOOK(malloc)(size_t size, const void *caller)
+{
+	return selected.malloc(size, caller);
+}
+void * OUR_HOOK(calloc)(size_t nmemb, size_t size, const void *caller)
+{
+	return selected.calloc(nmemb, size, caller);
+}
+void OUR_HOOK(free)(void *ptr, const void *caller)
+{
+	selected.free(ptr, caller);
+}
+void OUR_HOOK(free_sized)(void *ptr, size_t size, const void *caller)
+{
+	selected.free_sized(ptr, size, caller);
+}
+void * OUR_HOOK(realloc)(void *ptr, size_t size, const void *caller)
+{
+	return selected.realloc(ptr, size, caller);
+}
+void * OUR_HOOK(realloc_in_place)(void *ptr, size_t size, const void *caller)
+{
+	return selected.realloc_in_place(ptr, size, caller);
+}
+void ** OUR_HOOK(malloc_batch)(size_t n, const size_t *sizes, void **out, const void *caller)
+{
+	return selected.malloc_batch(n, sizes, out, caller);
+}
+void OUR_HOOK(free_batch)(void *const *ptrs, size_t n, const void *caller)
+{
+	selected.free_batch(ptrs, n, caller);
+}
+void * OUR_HOOK(memalign)(size_t alignment, size_t size, const void *caller)
+{
+	return selected.memalign(alignment, size, caller);
+}
+size_t OUR_HOOK(malloc_usable_size)(void *ptr)
+{
+	return selected.malloc_usable_size(ptr);
+}
+size_t OUR_HOOK(good_size)(size_t size, size_t alignment, const void *caller)
+{
+	return selected.good_size(size, alignment, caller);
+}
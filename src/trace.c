@@ -0,0 +1,382 @@
+/* A hook that records every call as a compact binary trace, in the
+ * format described in mallochooks/trace.h, for analysis (or replay, see
+ * test/replay.c) offline.
+ *
+ * The trace goes to a file named by $MALLOCHOOKS_TRACE (default
+ * "mallochooks-trace.<pid>"), which we size to TRACE_FILE_SIZE up front
+ * (sparsely) and map. Each thread claims blocks of the file with one
+ * atomic add, and encodes its records straight into its current block, so
+ * the per-call cost is a few dozen stores with no lock, no system call and
+ * no malloc. Once the file is full, further records are only counted.
+ * Blocks are always consistent up to their 'used' count, so a trace from
+ * a process that crashed can still be read. At normal exit we record the
+ * stop time and trim the file to the blocks used.
+ *
+ * A forked child lets go of its parent's file, and traces any further
+ * calls into one of its own: "mallochooks-trace.<pid>" by default, or
+ * $MALLOCHOOKS_TRACE with ".<pid>" appended.
+ *
+ * Each thread's records are in order. Across threads, ordering by ticks
+ * puts each free before any reuse of its chunk, since we time a free (and
+ * a realloc) before making the call, and an allocation after it. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdint.h>
+#include <stdlib.h>   /* for getenv */
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef OUR_HOOK
+#define OUR_HOOK(m) hook_ ## m
+#endif
+#ifndef NEXT_HOOK
+#define NEXT_HOOK(m) __terminal_hook_ ## m
+#endif
+
+/* Prototype the hooks we call... */
+#define HOOK_PREFIX(m) NEXT_HOOK(m)
+#include "mallochooks/hookapi.h"
+#undef HOOK_PREFIX
+/* ... and the ones we define. */
+#define HOOK_PREFIX(m) OUR_HOOK(m)
+#include "mallochooks/hookapi.h"
+#undef HOOK_PREFIX
+
+#include "mallochooks/trace.h"
+
+#ifndef TRACE_FILE_SIZE
+#define TRACE_FILE_SIZE (1ull<<32) /* a multiple of TRACE_BLOCK_SIZE */
+#endif
+#define TRACE_MAX_BLOCKS ((TRACE_FILE_SIZE - TRACE_BLOCK_SIZE) / TRACE_BLOCK_SIZE)
+
+/* The TSC is much cheaper to read than the clock, even via the vDSO. */
+#if defined(__x86_64__) || defined(__i386__)
+#define TRACE_FLAGS TRACE_TICKS_TSC
+#define TRACE_TICKS() __builtin_ia32_rdtsc()
+#else
+#define TRACE_FLAGS 0
+#define TRACE_TICKS() trace_now_ns()
+#endif
+
+enum { TRACE_UNOPENED, TRACE_OPENING, TRACE_OPEN, TRACE_FAILED };
+static int trace_state;
+static struct trace_file_header *trace_header; /* the start of the mapping */
+static int trace_fd = -1;
+static pid_t trace_pid;     /* who opened it */
+static _Bool trace_forked;  /* are we a child, tracing (if at all) afresh? */
+
+struct trace_thread
+{
+	struct trace_block_header *block;
+	unsigned char *pos;
+	unsigned char *limit; /* where a maximal record no longer fits */
+	struct trace_cursor cursor;
+	uint32_t tid;
+};
+/* Initial-exec, for the same reason as in terminal-indirect-dlsym.c. */
+static __thread struct trace_thread trace_thread __attribute__((tls_model("initial-exec")));
+
+static uint64_t trace_now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+/* prefix followed by our pid, without snprintf, which may allocate. */
+static char *trace_path_with_pid(char *buf, size_t len, const char *prefix)
+{
+	char digits[24];
+	unsigned n = 0;
+	unsigned long pid = (unsigned long) getpid();
+	do { digits[n++] = '0' + pid % 10; pid /= 10; } while (pid);
+	size_t prefix_len = strlen(prefix);
+	if (prefix_len + n + 1 > len) return NULL;
+	memcpy(buf, prefix, prefix_len);
+	char *pos = buf + prefix_len;
+	while (n) *pos++ = digits[--n];
+	*pos = '\0';
+	return buf;
+}
+
+static void trace_open(void)
+{
+	int state = TRACE_UNOPENED;
+	if (!__atomic_compare_exchange_n(&trace_state, &state, TRACE_OPENING,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		while ((state = __atomic_load_n(&trace_state, __ATOMIC_ACQUIRE)) == TRACE_OPENING);
+		return;
+	}
+	char buf[4096];
+	const char *path = getenv("MALLOCHOOKS_TRACE");
+	if (!path) path = trace_path_with_pid(buf, sizeof buf, "mallochooks-trace.");
+	else if (trace_forked)
+	{
+		/* Don't truncate our parent's trace. */
+		char prefix[4096 - 24];
+		size_t len = strlen(path);
+		if (len + 2 > sizeof prefix) path = NULL;
+		else
+		{
+			memcpy(prefix, path, len);
+			memcpy(prefix + len, ".", 2);
+			path = trace_path_with_pid(buf, sizeof buf, prefix);
+		}
+	}
+	void *mapping = MAP_FAILED;
+	int fd = path ? open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644) : -1;
+	if (fd != -1 && ftruncate(fd, TRACE_FILE_SIZE) == 0)
+	{
+		mapping = mmap(NULL, TRACE_FILE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE, fd, 0);
+	}
+	if (mapping == MAP_FAILED)
+	{
+		if (fd != -1) close(fd);
+		__atomic_store_n(&trace_state, TRACE_FAILED, __ATOMIC_RELEASE);
+		return;
+	}
+	trace_fd = fd;
+	trace_pid = getpid();
+	trace_header = mapping;
+	memcpy(trace_header->magic, TRACE_MAGIC, sizeof trace_header->magic);
+	trace_header->flags = TRACE_FLAGS;
+	trace_header->block_size = TRACE_BLOCK_SIZE;
+	trace_header->start_ns = trace_now_ns();
+	trace_header->start_ticks = TRACE_TICKS();
+	__atomic_store_n(&trace_state, TRACE_OPEN, __ATOMIC_RELEASE);
+}
+
+__attribute__((destructor))
+static void trace_close(void)
+{
+	if (__atomic_load_n(&trace_state, __ATOMIC_ACQUIRE) != TRACE_OPEN) return;
+	/* A child that got here without our fork handler (e.g. by a raw
+	 * clone) still has its parent's file, which it mustn't close. */
+	if (getpid() != trace_pid) return;
+	trace_header->stop_ticks = TRACE_TICKS();
+	trace_header->stop_ns = trace_now_ns();
+	/* Other threads (or later destructors) may still be writing, into
+	 * blocks they have claimed, so those stay in the file; but nobody may
+	 * claim another, since it would be past the end. */
+	uint64_t nblocks = __atomic_exchange_n(&trace_header->nblocks, TRACE_MAX_BLOCKS, __ATOMIC_ACQ_REL);
+	if (nblocks > TRACE_MAX_BLOCKS) nblocks = TRACE_MAX_BLOCKS;
+	if (ftruncate(trace_fd, (off_t) (nblocks + 1) * TRACE_BLOCK_SIZE) != 0) { /* keep it all */ }
+}
+
+/* The child's mapping is of the parent's file, and its one thread's
+ * block is one that the parent's thread goes on writing, so let go of
+ * both; the next record opens a file of the child's own. */
+static void trace_fork_child(void)
+{
+	memset(&trace_thread, 0, sizeof trace_thread);
+	if (trace_header) munmap(trace_header, TRACE_FILE_SIZE);
+	if (trace_fd != -1) close(trace_fd);
+	trace_header = NULL;
+	trace_fd = -1;
+	trace_forked = 1;
+	__atomic_store_n(&trace_state, TRACE_UNOPENED, __ATOMIC_RELEASE);
+}
+/* Not in trace_open, since pthread_atfork may allocate. */
+__attribute__((constructor))
+static void trace_register_fork_handler(void)
+{
+	pthread_atfork(NULL, NULL, trace_fork_child);
+}
+
+/* Get a new block for this thread, or return 0 if there are no more. */
+static _Bool trace_next_block(void)
+{
+	struct trace_thread *t = &trace_thread;
+	if (__builtin_expect(__atomic_load_n(&trace_state, __ATOMIC_ACQUIRE) != TRACE_OPEN, 0))
+	{
+		trace_open();
+		if (__atomic_load_n(&trace_state, __ATOMIC_ACQUIRE) != TRACE_OPEN) return 0;
+	}
+	/* Once the file is full, don't keep bumping the count. */
+	uint64_t n = __atomic_load_n(&trace_header->nblocks, __ATOMIC_RELAXED);
+	if (n < TRACE_MAX_BLOCKS) n = __atomic_fetch_add(&trace_header->nblocks, 1, __ATOMIC_RELAXED);
+	if (n >= TRACE_MAX_BLOCKS)
+	{
+		t->block = NULL;
+		t->pos = t->limit = NULL;
+		return 0;
+	}
+	if (!t->tid) t->tid = (uint32_t) syscall(SYS_gettid);
+	struct trace_block_header *b = (void *) ((char *) trace_header + (n + 1) * TRACE_BLOCK_SIZE);
+	b->tid = t->tid;
+	b->base_ticks = TRACE_TICKS();
+	t->block = b;
+	t->pos = (unsigned char *) (b + 1);
+	t->limit = (unsigned char *) b + TRACE_BLOCK_SIZE - TRACE_MAX_RECORD;
+	trace_cursor_init(&t->cursor, b);
+	return 1;
+}
+
+/* Start a record, returning where to write it, or NULL if we can't. */
+static inline unsigned char *trace_begin(void)
+{
+	struct trace_thread *t = &trace_thread;
+	if (__builtin_expect(t->pos >= t->limit, 0) && !trace_next_block())
+	{
+		if (trace_header) __atomic_add_fetch(&trace_header->dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	return t->pos;
+}
+
+static inline unsigned char *trace_put_addr(unsigned char *pos, const void *addr)
+{
+	struct trace_cursor *c = &trace_thread.cursor;
+	pos = trace_put_varint(pos, trace_zigzag((int64_t) ((uintptr_t) addr - c->addr)));
+	c->addr = (uintptr_t) addr;
+	return pos;
+}
+
+/* Write the op byte and the time, ahead of the op's own fields. */
+static inline unsigned char *trace_put_head(unsigned char *pos, enum trace_op op, const void *caller,
+	uint64_t now)
+{
+	struct trace_cursor *c = &trace_thread.cursor;
+	*pos++ = op | ((uintptr_t) caller == c->caller ? TRACE_SAME_CALLER : 0);
+	pos = trace_put_varint(pos, now - c->ticks);
+	c->ticks = now;
+	return pos;
+}
+
+/* Finish a record with its caller, and publish it. */
+static inline void trace_end(unsigned char *record, unsigned char *pos, const void *caller)
+{
+	struct trace_thread *t = &trace_thread;
+	if (!(*record & TRACE_SAME_CALLER))
+	{
+		pos = trace_put_varint(pos, trace_zigzag((int64_t) ((uintptr_t) caller - t->cursor.caller)));
+		t->cursor.caller = (uintptr_t) caller;
+	}
+	t->pos = pos;
+	__atomic_store_n(&t->block->used,
+		(uint32_t) (pos - (unsigned char *) (t->block + 1)), __ATOMIC_RELEASE);
+}
+
+static void trace_alloc(enum trace_op op, const void *addr, size_t size, size_t alignment,
+	const void *caller)
+{
+	unsigned char *record = trace_begin();
+	if (!record) return;
+	unsigned char *pos = trace_put_head(record, op, caller, TRACE_TICKS());
+	pos = trace_put_addr(pos, addr);
+	pos = trace_put_varint(pos, size);
+	if (op == TRACE_MEMALIGN) pos = trace_put_varint(pos, alignment);
+	trace_end(record, pos, caller);
+}
+
+static void trace_free(enum trace_op op, const void *addr, size_t size, const void *caller)
+{
+	unsigned char *record = trace_begin();
+	if (!record) return;
+	unsigned char *pos = trace_put_head(record, op, caller, TRACE_TICKS());
+	pos = trace_put_addr(pos, addr);
+	if (op == TRACE_FREE_SIZED) pos = trace_put_varint(pos, size);
+	trace_end(record, pos, caller);
+}
+
+static void trace_realloc(const void *old, const void *new_ptr, size_t size, const void *caller,
+	uint64_t start)
+{
+	unsigned char *record = trace_begin();
+	if (!record) return;
+	unsigned char *pos = trace_put_head(record, TRACE_REALLOC, caller, start);
+	pos = trace_put_addr(pos, old);
+	pos = trace_put_addr(pos, new_ptr);
+	pos = trace_put_varint(pos, size);
+	trace_end(record, pos, caller);
+}
+
+void OUR_HOOK(init)(void)
+{
+	NEXT_HOOK(init)();
+}
+
+void *OUR_HOOK(malloc)(size_t size, const void *caller)
+{
+	void *ret = NEXT_HOOK(malloc)(size, caller);
+	trace_alloc(TRACE_MALLOC, ret, size, 0, caller);
+	return ret;
+}
+
+void *OUR_HOOK(calloc)(size_t nmemb, size_t size, const void *caller)
+{
+	void *ret = NEXT_HOOK(calloc)(nmemb, size, caller);
+	trace_alloc(TRACE_CALLOC, ret, nmemb * size, 0, caller);
+	return ret;
+}
+
+/* Record frees first: afterwards, another thread may get the chunk, and
+ * a replay must see the free before that thread's malloc. */
+void OUR_HOOK(free)(void *ptr, const void *caller)
+{
+	if (ptr) trace_free(TRACE_FREE, ptr, 0, caller);
+	NEXT_HOOK(free)(ptr, caller);
+}
+
+void OUR_HOOK(free_sized)(void *ptr, size_t size, const void *caller)
+{
+	if (ptr) trace_free(TRACE_FREE_SIZED, ptr, size, caller);
+	NEXT_HOOK(free_sized)(ptr, size, caller);
+}
+
+/* A realloc is timestamped as of its start, since that is when the old
+ * chunk may be freed for others to get. */
+void *OUR_HOOK(realloc)(void *ptr, size_t size, const void *caller)
+{
+	uint64_t start = TRACE_TICKS();
+	void *ret = NEXT_HOOK(realloc)(ptr, size, caller);
+	trace_realloc(ptr, ret, size, caller, start);
+	return ret;
+}
+
+/* Batches are recorded chunk by chunk. */
+void **OUR_HOOK(malloc_batch)(size_t n, const size_t *sizes, void **out, const void *caller)
+{
+	void **ret = NEXT_HOOK(malloc_batch)(n, sizes, out, caller);
+	if (ret) for (size_t i = 0; i < n; ++i) trace_alloc(TRACE_MALLOC, out[i], sizes[i], 0, caller);
+	return ret;
+}
+
+void OUR_HOOK(free_batch)(void *const *ptrs, size_t n, const void *caller)
+{
+	for (size_t i = 0; i < n; ++i) if (ptrs[i]) trace_free(TRACE_FREE, ptrs[i], 0, caller);
+	NEXT_HOOK(free_batch)(ptrs, n, caller);
+}
+
+/* A successful one is recorded as a realloc that didn't move. */
+void *OUR_HOOK(realloc_in_place)(void *ptr, size_t size, const void *caller)
+{
+	void *ret = NEXT_HOOK(realloc_in_place)(ptr, size, caller);
+	if (ret) trace_realloc(ptr, ret, size, caller, TRACE_TICKS());
+	return ret;
+}
+
+void *OUR_HOOK(memalign)(size_t alignment, size_t size, const void *caller)
+{
+	void *ret = NEXT_HOOK(memalign)(alignment, size, caller);
+	trace_alloc(TRACE_MEMALIGN, ret, size, alignment, caller);
+	return ret;
+}
+
+size_t OUR_HOOK(malloc_usable_size)(void *ptr)
+{
+	return NEXT_HOOK(malloc_usable_size)(ptr);
+}
+
+size_t OUR_HOOK(good_size)(size_t size, size_t alignment, const void *caller)
+{
+	return NEXT_HOOK(good_size)(size, alignment, caller);
+}
@@ -1,8 +1,8 @@
 #include "mallochooks/userapi.h"
 #include "mallochooks/hookapi.h"
 
-#include <strings.h>  /* for bzero */
 #include <errno.h> /* for EINVAL */
+#include <unistd.h> /* for sysconf */
 
 #ifndef MALLOC_ATTRIBUTES
 #define MALLOC_ATTRIBUTES
@@ -27,8 +27,7 @@ MALLOC_ATTRIBUTES
 void *MALLOC_PREFIX(calloc)(size_t nmemb, size_t size)
 {
 	void *ret;
-	ret = HOOK_PREFIX(malloc)(nmemb * size, MALLOC_CALLER_EXPRESSION);
-	if (ret) bzero(ret, nmemb * size);
+	ret = HOOK_PREFIX(calloc)(nmemb, size, MALLOC_CALLER_EXPRESSION);
 	return ret;
 }
 MALLOC_ATTRIBUTES
@@ -37,6 +36,52 @@ void MALLOC_PREFIX(free)(void *ptr)
 	HOOK_PREFIX(free)(ptr, MALLOC_CALLER_EXPRESSION);
 }
 MALLOC_ATTRIBUTES
+void MALLOC_PREFIX(free_sized)(void *ptr, size_t size)
+{
+	HOOK_PREFIX(free_sized)(ptr, size, MALLOC_CALLER_EXPRESSION);
+}
+MALLOC_ATTRIBUTES
+void MALLOC_PREFIX(free_aligned_sized)(void *ptr, size_t alignment, size_t size)
+{
+	/* The alignment adds nothing the allocator needs in order to free. */
+	(void) alignment;
+	HOOK_PREFIX(free_sized)(ptr, size, MALLOC_CALLER_EXPRESSION);
+}
+/* C++ sized operator delete, by its mangled names, so that the size the
+ * compiler knows reaches the hooks too. This is opt-in: a program that
+ * replaces only the unsized operator delete expects the default sized one
+ * to call it, and defining these would break that. */
+#if defined(MALLOC_SIZED_DELETE) && __SIZEOF_SIZE_T__ == 8
+/* operator delete(void*, std::size_t) and operator delete[](void*, std::size_t) */
+void MALLOC_PREFIX(_ZdlPvm)(void *ptr, size_t size);
+void MALLOC_PREFIX(_ZdaPvm)(void *ptr, size_t size);
+/* ... and their std::align_val_t variants */
+void MALLOC_PREFIX(_ZdlPvmSt11align_val_t)(void *ptr, size_t size, size_t alignment);
+void MALLOC_PREFIX(_ZdaPvmSt11align_val_t)(void *ptr, size_t size, size_t alignment);
+MALLOC_ATTRIBUTES
+void MALLOC_PREFIX(_ZdlPvm)(void *ptr, size_t size)
+{
+	HOOK_PREFIX(free_sized)(ptr, size, MALLOC_CALLER_EXPRESSION);
+}
+MALLOC_ATTRIBUTES
+void MALLOC_PREFIX(_ZdaPvm)(void *ptr, size_t size)
+{
+	HOOK_PREFIX(free_sized)(ptr, size, MALLOC_CALLER_EXPRESSION);
+}
+MALLOC_ATTRIBUTES
+void MALLOC_PREFIX(_ZdlPvmSt11align_val_t)(void *ptr, size_t size, size_t alignment)
+{
+	(void) alignment;
+	HOOK_PREFIX(free_sized)(ptr, size, MALLOC_CALLER_EXPRESSION);
+}
+MALLOC_ATTRIBUTES
+void MALLOC_PREFIX(_ZdaPvmSt11align_val_t)(void *ptr, size_t size, size_t alignment)
+{
+	(void) alignment;
+	HOOK_PREFIX(free_sized)(ptr, size, MALLOC_CALLER_EXPRESSION);
+}
+#endif
+MALLOC_ATTRIBUTES
 void *MALLOC_PREFIX(realloc)(void *ptr, size_t size)
 {
 	void *ret;
@@ -44,27 +89,91 @@ void *MALLOC_PREFIX(realloc)(void *ptr, size_t size)
 	return ret;
 }
 MALLOC_ATTRIBUTES
+void *MALLOC_PREFIX(realloc_in_place)(void *ptr, size_t size)
+{
+	return HOOK_PREFIX(realloc_in_place)(ptr, size, MALLOC_CALLER_EXPRESSION);
+}
+MALLOC_ATTRIBUTES
+void **MALLOC_PREFIX(malloc_batch)(size_t n, const size_t *sizes, void **out)
+{
+	return HOOK_PREFIX(malloc_batch)(n, sizes, out, MALLOC_CALLER_EXPRESSION);
+}
+MALLOC_ATTRIBUTES
+void MALLOC_PREFIX(free_batch)(void *const *ptrs, size_t n)
+{
+	HOOK_PREFIX(free_batch)(ptrs, n, MALLOC_CALLER_EXPRESSION);
+}
+MALLOC_ATTRIBUTES
 void *MALLOC_PREFIX(memalign)(size_t boundary, size_t size)
 {
 	void *ret;
 	ret = HOOK_PREFIX(memalign)(boundary, size, MALLOC_CALLER_EXPRESSION);
 	return ret;
 }
+/* The aligned entry points all become memalign. Those with a defined
+ * error for a bad alignment check it here, so the hooks never see one. */
+static inline int is_power_of_two(size_t n)
+{
+	return n != 0 && (n & (n - 1)) == 0;
+}
 MALLOC_ATTRIBUTES
 int MALLOC_PREFIX(posix_memalign)(void **memptr, size_t alignment, size_t size)
 {
-	void *ret;
-	ret = HOOK_PREFIX(memalign)(alignment, size, MALLOC_CALLER_EXPRESSION);
-	
-	if (!ret) return EINVAL; /* FIXME: check alignment, return ENOMEM/EINVAL as appropriate */
-	else
+	if (!is_power_of_two(alignment) || alignment % sizeof (void *) != 0) return EINVAL;
+	/* We return the error, and must leave errno alone. */
+	int saved_errno = errno;
+	void *ret = HOOK_PREFIX(memalign)(alignment, size, MALLOC_CALLER_EXPRESSION);
+	errno = saved_errno;
+	if (!ret) return ENOMEM;
+	*memptr = ret;
+	return 0;
+}
+MALLOC_ATTRIBUTES
+void *MALLOC_PREFIX(aligned_alloc)(size_t alignment, size_t size)
+{
+	if (!is_power_of_two(alignment))
 	{
-		*memptr = ret;
-		return 0;
+		errno = EINVAL;
+		return NULL;
 	}
+	return HOOK_PREFIX(memalign)(alignment, size, MALLOC_CALLER_EXPRESSION);
+}
+static size_t page_size(void)
+{
+	static size_t cached;
+	if (!cached) cached = sysconf(_SC_PAGESIZE);
+	return cached;
+}
+MALLOC_ATTRIBUTES
+void *MALLOC_PREFIX(valloc)(size_t size)
+{
+	return HOOK_PREFIX(memalign)(page_size(), size, MALLOC_CALLER_EXPRESSION);
+}
+MALLOC_ATTRIBUTES
+void *MALLOC_PREFIX(pvalloc)(size_t size)
+{
+	/* Round up to whole pages (at least one), as glibc does. */
+	size_t page = page_size();
+	size_t rounded = size ? (size + page - 1) & ~(page - 1) : page;
+	if (rounded < size)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	return HOOK_PREFIX(memalign)(page, rounded, MALLOC_CALLER_EXPRESSION);
 }
 MALLOC_ATTRIBUTES
 size_t MALLOC_PREFIX(malloc_usable_size)(void *ptr)
 {
 	return HOOK_PREFIX(malloc_usable_size)(ptr);
 }
+MALLOC_ATTRIBUTES
+size_t MALLOC_PREFIX(malloc_good_size)(size_t size)
+{
+	return HOOK_PREFIX(good_size)(size, 0, MALLOC_CALLER_EXPRESSION);
+}
+MALLOC_ATTRIBUTES
+size_t MALLOC_PREFIX(memalign_good_size)(size_t alignment, size_t size)
+{
+	return HOOK_PREFIX(good_size)(size, alignment, MALLOC_CALLER_EXPRESSION);
+}
@@ -0,0 +1,132 @@
+/* Time the malloc family, for comparing hooked and unhooked builds.
+ *
+ * usage: bench <config> <build> [threads]
+ *
+ * Each timed op is run in batches: a batch of mallocs (or callocs, or
+ * memaligns) is timed, then a batch of frees of the same chunks; realloc
+ * doubles each chunk of a batch. With threads > 1, every thread runs the
+ * same batches at once, and we report the mean over threads. Sizes above
+ * 1kB get proportionally fewer rounds, since they may each be an mmap
+ * (which is what makes them slow anyway). One CSV line
+ * per (op, size, threads) goes to stdout:
+ *
+ *   config,build,op,size,threads,ns_per_op
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#ifndef BENCH_BATCH
+#define BENCH_BATCH 1000
+#endif
+#ifndef BENCH_ROUNDS
+#define BENCH_ROUNDS 200
+#endif
+
+static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 65536 };
+#define NSIZES (sizeof sizes / sizeof sizes[0])
+enum op { OP_MALLOC, OP_FREE, OP_CALLOC, OP_MEMALIGN, OP_REALLOC, NOPS };
+static const char *op_names[] = { "malloc", "free", "calloc", "memalign", "realloc" };
+
+struct result { double ns[NOPS][NSIZES]; };
+static pthread_barrier_t barrier;
+
+static unsigned rounds_for(size_t size)
+{
+	return size > 1024 ? (BENCH_ROUNDS * 1024 / size) + 1 : BENCH_ROUNDS;
+}
+
+static inline double now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* Touch each chunk, so that the compiler cannot elide the calls. */
+static void touch(void **ptrs, size_t size)
+{
+	for (unsigned i = 0; i < BENCH_BATCH; ++i) if (ptrs[i]) ((volatile char *) ptrs[i])[size - 1] = 1;
+}
+static double time_frees(void **ptrs)
+{
+	double start = now_ns();
+	for (unsigned i = 0; i < BENCH_BATCH; ++i) free(ptrs[i]);
+	return now_ns() - start;
+}
+
+static void *run(void *arg)
+{
+	struct result *r = arg;
+	void **ptrs = calloc(BENCH_BATCH, sizeof (void*));
+	memset(r, 0, sizeof *r);
+	pthread_barrier_wait(&barrier);
+	for (unsigned s = 0; s < NSIZES; ++s)
+	{
+		size_t size = sizes[s];
+		for (unsigned round = 0; round < rounds_for(size); ++round)
+		{
+			double start = now_ns();
+			for (unsigned i = 0; i < BENCH_BATCH; ++i) ptrs[i] = malloc(size);
+			r->ns[OP_MALLOC][s] += now_ns() - start;
+			touch(ptrs, size);
+			start = now_ns();
+			for (unsigned i = 0; i < BENCH_BATCH; ++i) ptrs[i] = realloc(ptrs[i], 2 * size);
+			r->ns[OP_REALLOC][s] += now_ns() - start;
+			touch(ptrs, 2 * size);
+			r->ns[OP_FREE][s] += time_frees(ptrs);
+
+			start = now_ns();
+			for (unsigned i = 0; i < BENCH_BATCH; ++i) ptrs[i] = calloc(1, size);
+			r->ns[OP_CALLOC][s] += now_ns() - start;
+			touch(ptrs, size);
+			time_frees(ptrs);
+
+			start = now_ns();
+			for (unsigned i = 0; i < BENCH_BATCH; ++i) ptrs[i] = memalign(64, size);
+			r->ns[OP_MEMALIGN][s] += now_ns() - start;
+			touch(ptrs, size);
+			time_frees(ptrs);
+		}
+	}
+	free(ptrs);
+	return NULL;
+}
+
+static void bench(const char *config, const char *build, unsigned nthreads)
+{
+	pthread_t threads[nthreads];
+	struct result results[nthreads];
+	pthread_barrier_init(&barrier, NULL, nthreads);
+	for (unsigned t = 1; t < nthreads; ++t) pthread_create(&threads[t], NULL, run, &results[t]);
+	run(&results[0]);
+	for (unsigned t = 1; t < nthreads; ++t) pthread_join(threads[t], NULL);
+	pthread_barrier_destroy(&barrier);
+	for (unsigned op = 0; op < NOPS; ++op)
+	{
+		for (unsigned s = 0; s < NSIZES; ++s)
+		{
+			double total = 0;
+			for (unsigned t = 0; t < nthreads; ++t) total += results[t].ns[op][s];
+			printf("%s,%s,%s,%zu,%u,%.2f\n", config, build, op_names[op], sizes[s], nthreads,
+				total / ((double) nthreads * rounds_for(sizes[s]) * BENCH_BATCH));
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3)
+	{
+		fprintf(stderr, "usage: %s <config> <build> [threads]\n", argv[0]);
+		return 1;
+	}
+	unsigned nthreads = argc > 3 ? atoi(argv[3]) : 4;
+	bench(argv[1], argv[2], 1);
+	if (nthreads > 1) bench(argv[1], argv[2], nthreads);
+	return 0;
+}
@@ -0,0 +1,141 @@
+/* Measure what each hook in a chain costs.
+ *
+ * usage: chain-bench <chain-length>
+ *
+ * We are linked (see the chain-bench rules in Makefile) with a chain of
+ * <chain-length> copies of hook2event, whose event handlers are the empty
+ * ones below, over terminal-direct and dlmalloc. We time batches of
+ * malloc, free, calloc and realloc calls, and count user-mode instructions
+ * retired over the same batches using perf_event_open. One CSV line per op
+ * goes to stdout:
+ *
+ *   chain_length,op,ns_per_call,instructions_per_call
+ *
+ * If perf events are not available (e.g. perf_event_paranoid, or a
+ * container), the instruction count is reported as NA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "mallochooks/eventapi.h"
+
+/* Every hook in the chain calls these. */
+void post_init(void) {}
+void pre_alloc(size_t *p_size, size_t *p_alignment, const void *caller) {}
+void post_successful_alloc(void *allocated, size_t modified_size, size_t modified_alignment,
+	size_t requested_size, size_t requested_alignment, const void *caller) {}
+int pre_nonnull_free(void *userptr, size_t freed_usable_size) { return 0; }
+void post_nonnull_free(void *userptr) {}
+void pre_nonnull_nonzero_realloc(void *userptr, size_t size, const void *caller) {}
+void post_nonnull_nonzero_realloc(void *userptr, size_t modified_size,
+	size_t old_usable_size, const void *caller, void *__new) {}
+
+#ifndef CHAIN_BENCH_BATCH
+#define CHAIN_BENCH_BATCH 1000
+#endif
+#ifndef CHAIN_BENCH_ROUNDS
+#define CHAIN_BENCH_ROUNDS 1000
+#endif
+#ifndef CHAIN_BENCH_SIZE
+#define CHAIN_BENCH_SIZE 64
+#endif
+
+enum op { OP_MALLOC, OP_FREE, OP_CALLOC, OP_REALLOC, NOPS };
+static const char *op_names[] = { "malloc", "free", "calloc", "realloc" };
+static double ns[NOPS];
+static unsigned long long instructions[NOPS];
+static int perf_fd = -1;
+static void *ptrs[CHAIN_BENCH_BATCH];
+
+static void open_counter(void)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static double now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* Bracket one batch of an op. */
+static double start_time;
+static void start(void)
+{
+	if (perf_fd != -1)
+	{
+		ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	start_time = now_ns();
+}
+static void stop(enum op op)
+{
+	double end = now_ns();
+	if (perf_fd != -1)
+	{
+		unsigned long long count;
+		ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(perf_fd, &count, sizeof count) == sizeof count) instructions[op] += count;
+	}
+	ns[op] += end - start_time;
+}
+
+/* Touch each chunk, so that the compiler cannot elide the calls. */
+static void touch(void)
+{
+	for (unsigned i = 0; i < CHAIN_BENCH_BATCH; ++i) ((volatile char *) ptrs[i])[0] = 1;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s <chain-length>\n", argv[0]);
+		return 1;
+	}
+	open_counter();
+	for (unsigned round = 0; round < CHAIN_BENCH_ROUNDS; ++round)
+	{
+		start();
+		for (unsigned i = 0; i < CHAIN_BENCH_BATCH; ++i) ptrs[i] = malloc(CHAIN_BENCH_SIZE);
+		stop(OP_MALLOC);
+		touch();
+		start();
+		for (unsigned i = 0; i < CHAIN_BENCH_BATCH; ++i) ptrs[i] = realloc(ptrs[i], 2 * CHAIN_BENCH_SIZE);
+		stop(OP_REALLOC);
+		touch();
+		start();
+		for (unsigned i = 0; i < CHAIN_BENCH_BATCH; ++i) free(ptrs[i]);
+		stop(OP_FREE);
+		start();
+		for (unsigned i = 0; i < CHAIN_BENCH_BATCH; ++i) ptrs[i] = calloc(1, CHAIN_BENCH_SIZE);
+		stop(OP_CALLOC);
+		touch();
+		for (unsigned i = 0; i < CHAIN_BENCH_BATCH; ++i) free(ptrs[i]);
+	}
+	double calls = (double) CHAIN_BENCH_ROUNDS * CHAIN_BENCH_BATCH;
+	for (unsigned op = 0; op < NOPS; ++op)
+	{
+		if (perf_fd != -1) printf("%s,%s,%.2f,%.1f\n", argv[1], op_names[op], ns[op] / calls,
+			instructions[op] / calls);
+		else printf("%s,%s,%.2f,NA\n", argv[1], op_names[op], ns[op] / calls);
+	}
+	return 0;
+}
@@ -0,0 +1,90 @@
+/* Check malloc_batch and free_batch through hook2event: batches bigger
+ * than its groups come out whole, are reported one event per group, and
+ * go back whole, and a batch that fails part way leaves nothing behind.
+ * hook2event is built with only pre_nonnull_free and the batch events. */
+#include <stdint.h>
+#include <string.h>
+#include "check.h"
+#include "mallochooks/userapi.h"
+#include "mallochooks/eventapi.h"
+
+/* Over two of hook2event's groups of 64. */
+#define NCHUNKS 150
+
+static size_t nallocated, nalloc_events, nfreed, nfree_events, npre_frees;
+static size_t largest_event;
+static _Bool sizes_ok = 1;
+static void *keep; /* a free of this is cancelled */
+
+void post_successful_alloc_batch(size_t n, void *const *allocated,
+	const size_t *modified_sizes, const size_t *requested_sizes,
+	const void *caller)
+{
+	(void) caller;
+	for (size_t i = 0; i < n; ++i)
+	{
+		sizes_ok &= modified_sizes[i] == requested_sizes[i]
+			&& malloc_usable_size(allocated[i]) >= requested_sizes[i];
+	}
+	nallocated += n;
+	++nalloc_events;
+	if (n > largest_event) largest_event = n;
+}
+int pre_nonnull_free(void *userptr, size_t freed_usable_size)
+{
+	(void) freed_usable_size;
+	++npre_frees;
+	return userptr == keep;
+}
+void post_nonnull_free_batch(void *const *userptrs, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) sizes_ok &= userptrs[i] != keep;
+	nfreed += n;
+	++nfree_events;
+	if (n > largest_event) largest_event = n;
+}
+
+int main(void)
+{
+	static size_t sizes[NCHUNKS];
+	static void *chunks[NCHUNKS];
+	static void *with_nulls[2 * NCHUNKS];
+	for (int i = 0; i < NCHUNKS; ++i) sizes[i] = 8 + 8 * (i % 50);
+	size_t before = check_in_use();
+
+	CHECK(chunks == malloc_batch(NCHUNKS, sizes, chunks));
+	for (int i = 0; i < NCHUNKS; ++i) memset(chunks[i], i, sizes[i]);
+	for (int i = 0; i < NCHUNKS; ++i)
+	{
+		CHECK(((unsigned char *) chunks[i])[0] == (unsigned char) i);
+		CHECK(((unsigned char *) chunks[i])[sizes[i] - 1] == (unsigned char) i);
+	}
+	CHECK(nallocated == NCHUNKS);
+	CHECK(nalloc_events == 3);
+	CHECK(largest_event == 64);
+
+	/* Null pointers are skipped, and a cancelled free leaves its chunk. */
+	for (int i = 0; i < NCHUNKS; ++i) with_nulls[2 * i + 1] = chunks[i];
+	keep = chunks[NCHUNKS / 2];
+	free_batch(with_nulls, 2 * NCHUNKS);
+	CHECK(npre_frees == NCHUNKS);
+	CHECK(nfreed == NCHUNKS - 1);
+	CHECK(nfree_events == 5);
+	CHECK(((unsigned char *) keep)[0] == (unsigned char) (NCHUNKS / 2));
+	keep = NULL;
+	free(chunks[NCHUNKS / 2]);
+	CHECK(check_in_use() == before);
+
+	/* A chunk too big for the heap, in the last group: the others are
+	 * reported allocated, then freed. */
+	sizes[NCHUNKS - 1] = SIZE_MAX / 2;
+	nallocated = nfreed = 0;
+	CHECK(NULL == malloc_batch(NCHUNKS, sizes, chunks));
+	CHECK(nallocated == 128);
+	CHECK(nfreed == 128);
+	CHECK(check_in_use() == before);
+
+	CHECK(sizes_ok);
+	printf("batch: ok\n");
+	return 0;
+}
@@ -0,0 +1,41 @@
+/* Check that a chain composed with chain.hpp works as its doc comment
+ * says: this is that comment's example, with its entry points generated
+ * from user2hook.c, over the dlmalloc that --wrap renames to __real_. */
+#include "check.h"
+#include "mallochooks/chain.hpp"
+
+template <class Next> struct count_mallocs : mallochooks::pass_through<Next>
+{
+	static unsigned long n;
+	static void *malloc(size_t size, const void *caller)
+	{ ++n; return Next::malloc(size, caller); }
+};
+template <class Next> unsigned long count_mallocs<Next>::n;
+
+typedef mallochooks::chain<
+	mallochooks::layer<count_mallocs>,
+	mallochooks::terminal_direct
+> my_chain;
+
+#define HOOK_PREFIX(m) my_chain_hook_ ## m
+MALLOCHOOKS_DEFINE_HOOKS(my_chain)
+extern "C" {
+#include "user2hook.c"
+}
+
+#define NCHUNKS 10
+
+int main()
+{
+	void *chunks[NCHUNKS];
+	unsigned long before = my_chain::n;
+	for (int i = 0; i < NCHUNKS; ++i) CHECK(0 != (chunks[i] = malloc(100)));
+	unsigned long after = my_chain::n;
+	/* ... and they came from dlmalloc, at the end of the chain. */
+	size_t in_use = check_in_use();
+	for (int i = 0; i < NCHUNKS; ++i) free(chunks[i]);
+	CHECK(after - before == NCHUNKS);
+	CHECK(in_use >= check_in_use() + NCHUNKS * 100);
+	printf("chain: ok\n");
+	return 0;
+}
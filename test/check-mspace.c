@@ -0,0 +1,66 @@
+/* Check terminal-mspace: a chunk freed by another thread goes back to its
+ * owner's mspace, a realloc of another thread's chunk keeps its contents,
+ * and freeing a chunk that none of our mspaces owns aborts. */
+#define _GNU_SOURCE
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "check.h"
+
+#define NCHUNKS 100
+static void *chunks[NCHUNKS];
+
+static void *free_chunks(void *arg)
+{
+	for (int i = 0; i < NCHUNKS; ++i) free(chunks[i]);
+	return NULL;
+}
+
+static void *realloc_chunk(void *arg)
+{
+	return realloc(arg, 1000);
+}
+
+int main(void)
+{
+	char *lowest = NULL, *highest = NULL;
+	for (int i = 0; i < NCHUNKS; ++i)
+	{
+		chunks[i] = malloc(64);
+		CHECK(chunks[i] != NULL);
+		if (!lowest || (char *) chunks[i] < lowest) lowest = chunks[i];
+		if (!highest || (char *) chunks[i] > highest) highest = chunks[i];
+	}
+	pthread_t t;
+	CHECK(0 == pthread_create(&t, NULL, free_chunks, NULL));
+	CHECK(0 == pthread_join(t, NULL));
+	/* Our next malloc takes in those frees, so can reuse their space. */
+	char *again = malloc(64);
+	CHECK(again >= lowest && again <= highest);
+	free(again);
+
+	char *mine = malloc(32);
+	strcpy(mine, "moved by another thread");
+	char *moved;
+	CHECK(0 == pthread_create(&t, NULL, realloc_chunk, mine));
+	CHECK(0 == pthread_join(t, (void **) &moved));
+	CHECK(moved && moved != mine && malloc_usable_size(moved) >= 1000);
+	CHECK(0 == strcmp(moved, "moved by another thread"));
+	free(moved);
+
+	/* strdup's chunk is from dlmalloc's own malloc, not one of our mspaces. */
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		free(strdup("not ours"));
+		_exit(0);
+	}
+	int status;
+	CHECK(pid == waitpid(pid, &status, 0));
+	CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+
+	printf("mspace: ok\n");
+	return 0;
+}
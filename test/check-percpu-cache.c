@@ -0,0 +1,83 @@
+/* Check percpu-cache under many more threads than CPUs, so that its
+ * restartable sequences are often preempted and migrated: every chunk
+ * handed out must be nobody else's, whichever thread or CPU frees it. */
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "check.h"
+#include "mallochooks/userapi.h"
+
+#define NTHREADS 16
+#define NITERS 200000
+#define NLIVE 32
+#define NSLOTS 64
+/* Mostly within its classes (up to 256 bytes), some beyond. */
+#define MAX_SIZE 320
+
+/* A chunk holds its size, then a byte pattern made from its address. */
+static void fill(void *chunk, size_t size)
+{
+	*(size_t *) chunk = size;
+	memset((char *) chunk + sizeof (size_t), (int) ((uintptr_t) chunk >> 4), size - sizeof (size_t));
+}
+static void check_and_free(void *chunk, _Bool sized)
+{
+	size_t size = *(size_t *) chunk;
+	unsigned char expected = (unsigned char) ((uintptr_t) chunk >> 4);
+	for (size_t i = sizeof (size_t); i < size; ++i) CHECK(((unsigned char *) chunk)[i] == expected);
+	if (sized) free_sized(chunk, size); else free(chunk);
+}
+
+/* Chunks passed between threads, to be freed by whoever takes them. */
+static void *slots[NSLOTS];
+
+static void *churn(void *arg)
+{
+	unsigned seed = (unsigned) (uintptr_t) arg;
+	void *live[NLIVE] = { NULL };
+	for (int n = 0; n < NITERS; ++n)
+	{
+		seed = seed * 1103515245u + 12345u;
+		unsigned r = seed >> 8;
+		size_t size = sizeof (size_t) + 1 + r % (MAX_SIZE - sizeof (size_t));
+		void *chunk = (r & 0x10000) ? calloc(1, size) : malloc(size);
+		CHECK(chunk != NULL);
+		fill(chunk, size);
+		/* Keep it, or swap it for one that another thread made. */
+		void **where = (r & 0x20000) ? &slots[r % NSLOTS] : &live[r % NLIVE];
+		void *old = __atomic_exchange_n(where, chunk, __ATOMIC_ACQ_REL);
+		if (old) check_and_free(old, r & 0x40000);
+	}
+	for (int i = 0; i < NLIVE; ++i) if (live[i]) check_and_free(live[i], 0);
+	return NULL;
+}
+
+/* Set by glibc (2.35 and later) if it registered rseq for its threads. */
+extern const unsigned int __rseq_size __attribute__((weak));
+
+int main(void)
+{
+	size_t before = check_in_use();
+
+	/* If rseq works here, freed small chunks stay cached. */
+	void *chunks[10];
+	for (int i = 0; i < 10; ++i) chunks[i] = malloc(100);
+	for (int i = 0; i < 10; ++i) free(chunks[i]);
+	if (&__rseq_size && __rseq_size) CHECK(check_in_use() >= before + 10 * 100);
+
+	pthread_t threads[NTHREADS];
+	for (int i = 0; i < NTHREADS; ++i)
+	{
+		CHECK(0 == pthread_create(&threads[i], NULL, churn, (void *) (uintptr_t) (i + 1)));
+	}
+	for (int i = 0; i < NTHREADS; ++i) CHECK(0 == pthread_join(threads[i], NULL));
+	for (int i = 0; i < NSLOTS; ++i) if (slots[i]) check_and_free(slots[i], 0);
+
+	/* What is left is in the caches, which are bounded per CPU. */
+	long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	CHECK(check_in_use() - before <= (size_t) ncpus * (256 / 16) * 64 * (256 + 16)
+		+ NTHREADS * 4096 /* for the threads' own */);
+	printf("percpu-cache: ok\n");
+	return 0;
+}
@@ -0,0 +1,129 @@
+/* Check terminal-mspace's remote frees: while two owners wait, several
+ * threads at once free the owners' chunks, some one by one and some with
+ * free_batch, whose batches mix both owners' chunks with the freeing
+ * thread's own. After each round, each owner's next malloc must take all
+ * of them back into its mspace, and nothing may have been reused while
+ * still live. */
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include "check.h"
+#include "mallochooks/userapi.h"
+
+/* From dlmalloc, built with MSPACES and FOOTERS. */
+void *mspace_of(const void *mem);
+struct dlmalloc_mallinfo mspace_mallinfo(void *msp);
+
+#define NROUNDS 50
+#define NFREERS 4
+#define NPERFREER 250 /* per owner, so each batch is > 64 */
+#define NCHUNKS (NFREERS * NPERFREER)
+#define CHUNK_SIZE 48
+
+/* Both owners' chunks, interleaved: even from the main thread, odd from
+ * the other owner. */
+static void *chunks[2 * NCHUNKS];
+static pthread_barrier_t round_start, round_end;
+
+static void fill(void *chunk)
+{
+	memset(chunk, (int) ((uintptr_t) chunk >> 4), CHUNK_SIZE);
+}
+static void check_filled(void *chunk)
+{
+	unsigned char expected = (unsigned char) ((uintptr_t) chunk >> 4);
+	for (int i = 0; i < CHUNK_SIZE; ++i) CHECK(((unsigned char *) chunk)[i] == expected);
+}
+
+/* Allocate our half of chunks[] from our mspace, and check its usage
+ * once everything has been freed back to us. */
+static void owner_rounds(int parity)
+{
+	void *msp = NULL;
+	size_t baseline = 0;
+	for (int r = 0; r < NROUNDS; ++r)
+	{
+		for (int i = parity; i < 2 * NCHUNKS; i += 2)
+		{
+			CHECK(0 != (chunks[i] = malloc(CHUNK_SIZE)));
+			fill(chunks[i]);
+			if (!msp) msp = mspace_of(chunks[i]);
+			CHECK(mspace_of(chunks[i]) == msp);
+		}
+		pthread_barrier_wait(&round_start);
+		/* ... the freers run ... */
+		pthread_barrier_wait(&round_end);
+		free(malloc(CHUNK_SIZE)); /* takes in the remote frees */
+		size_t in_use = mspace_mallinfo(msp).uordblks;
+		if (r == 0) baseline = in_use;
+		CHECK(in_use == baseline);
+	}
+}
+
+static void *other_owner(void *arg)
+{
+	owner_rounds(1);
+	return NULL;
+}
+
+/* Free our share of chunks[]: the odd-numbered freers one by one, the
+ * others with free_batch, in runs of each owner's chunks broken by some
+ * of our own, and a null. */
+#define RUN 3
+static void *freer(void *arg)
+{
+	int n = (int) (uintptr_t) arg;
+	void **ours = chunks + 2 * n * NPERFREER;
+	void *batch[2 * NPERFREER + NPERFREER / RUN + 3];
+	size_t k = 0;
+	for (int i = 0; i < 2 * NPERFREER; ++i) check_filled(ours[i]);
+	if (n % 2)
+	{
+		for (int i = 0; i < 2 * NPERFREER; ++i) free(ours[i]);
+		return NULL;
+	}
+	for (int i = 0; i < NPERFREER; i += RUN)
+	{
+		for (int owner = 0; owner < 2; ++owner)
+		{
+			for (int j = i; j < i + RUN && j < NPERFREER; ++j) batch[k++] = ours[2 * j + owner];
+		}
+		CHECK(0 != (batch[k++] = malloc(CHUNK_SIZE)));
+	}
+	batch[k++] = NULL;
+	free_batch(batch, k);
+	return NULL;
+}
+
+/* Start the freers once both owners have allocated, and let the owners
+ * go on once they have finished. */
+static void *run_freers(void *arg)
+{
+	for (int r = 0; r < NROUNDS; ++r)
+	{
+		pthread_barrier_wait(&round_start);
+		pthread_t t[NFREERS];
+		for (int i = 0; i < NFREERS; ++i)
+		{
+			CHECK(0 == pthread_create(&t[i], NULL, freer, (void *) (uintptr_t) i));
+		}
+		for (int i = 0; i < NFREERS; ++i) CHECK(0 == pthread_join(t[i], NULL));
+		pthread_barrier_wait(&round_end);
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	CHECK(0 == pthread_barrier_init(&round_start, NULL, 3));
+	CHECK(0 == pthread_barrier_init(&round_end, NULL, 3));
+	pthread_t other, freers_control;
+	CHECK(0 == pthread_create(&other, NULL, other_owner, NULL));
+	CHECK(0 == pthread_create(&freers_control, NULL, run_freers, NULL));
+
+	owner_rounds(0);
+	CHECK(0 == pthread_join(other, NULL));
+	CHECK(0 == pthread_join(freers_control, NULL));
+	printf("remote-free: ok\n");
+	return 0;
+}
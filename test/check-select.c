@@ -0,0 +1,42 @@
+/* Check terminal-select's choice of backend: by default, dlmalloc
+ * directly; with MALLOCHOOKS_TERMINAL=slab, the slab hook stacked over
+ * it. We run ourselves again to try the second. */
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "check.h"
+
+int main(int argc, char **argv)
+{
+	const char *chosen = getenv("MALLOCHOOKS_TERMINAL");
+	/* dlmalloc pads a 32-byte request; slab has a class of exactly that. */
+	void *small = malloc(32);
+	void *big = malloc(1000);
+	CHECK(small && big);
+	memset(small, 1, 32);
+	memset(big, 2, 1000);
+	if (chosen && 0 == strcmp(chosen, "slab")) CHECK(malloc_usable_size(small) == 32);
+	else CHECK(malloc_usable_size(small) > 32);
+	CHECK(malloc_usable_size(big) >= 1000);
+	/* Big ones go on down, to dlmalloc, either way. */
+	size_t in_use = check_in_use();
+	free(big);
+	CHECK(check_in_use() < in_use);
+	free(small);
+
+	if (!chosen)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			setenv("MALLOCHOOKS_TERMINAL", "slab", 1);
+			execv("/proc/self/exe", argv);
+			_exit(127);
+		}
+		int status;
+		CHECK(pid == waitpid(pid, &status, 0));
+		CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+	printf("select (%s): ok\n", chosen ? chosen : "default");
+	return 0;
+}
@@ -0,0 +1,47 @@
+/* Check that C++'s sized operator deletes reach the hooks as free_sized,
+ * with the sizes the compiler knows. We are built with
+ * MALLOCHOOKS_SIZED_DELETE, and hook2event with only a pre_nonnull_free
+ * handler, which then sees the size passed to free_sized. */
+#include <cstddef>
+#include "check.h"
+extern "C" {
+#include "mallochooks/eventapi.h"
+}
+
+static void *watched;
+static size_t watched_size;
+static unsigned watched_frees;
+
+extern "C" int pre_nonnull_free(void *userptr, size_t freed_usable_size)
+{
+	if (userptr == watched)
+	{
+		watched_size = freed_usable_size;
+		++watched_frees;
+	}
+	return 0;
+}
+
+/* Sizes that no allocator would round to. */
+struct odd { char bytes[41]; };
+/* A destructor gives new[] a cookie, and delete[] a size. */
+struct odd_with_dtor { char bytes[43]; ~odd_with_dtor() {} };
+
+int main()
+{
+	odd *o = new odd;
+	watched = o;
+	delete o;
+	CHECK(watched_frees == 1);
+	CHECK(watched_size == sizeof (odd));
+
+	odd_with_dtor *os = new odd_with_dtor[3];
+	/* delete[] frees from the cookie, just before the array */
+	watched = reinterpret_cast<char *>(os) - sizeof (size_t);
+	delete[] os;
+	CHECK(watched_frees == 2);
+	CHECK(watched_size == 3 * sizeof (odd_with_dtor) + sizeof (size_t));
+
+	printf("sized-delete: ok\n");
+	return 0;
+}
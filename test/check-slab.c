@@ -0,0 +1,74 @@
+/* Check slab over dlmalloc: small chunks are exactly their class's size,
+ * realloc moves a chunk between classes and down to dlmalloc with its
+ * contents, and a malloc_batch that fails part way frees both its slab
+ * chunks and those from below. */
+#include <stdint.h>
+#include <string.h>
+#include "check.h"
+#include "mallochooks/userapi.h"
+
+#define NBATCH 100 /* over slab's groups of 64 */
+
+int main(void)
+{
+	/* Grow dlmalloc's heap first. After a failed request, it no longer
+	 * extends its heap in place, and each new piece costs it some bytes
+	 * in use. */
+	free(malloc(200000));
+	size_t before = check_in_use();
+
+	/* First, while no chunks of these classes exist: in the first group,
+	 * 128-byte chunks from slab and bigger ones from dlmalloc; in the
+	 * second, 112-byte chunks and one chunk too big for anything. */
+	size_t sizes[NBATCH];
+	void *failed[NBATCH], *chunks[NBATCH];
+	for (int i = 0; i < NBATCH; ++i) sizes[i] = i < 64 ? (i % 3 ? 1000 : 128) : (i % 3 ? 112 : 2000);
+	sizes[NBATCH - 1] = SIZE_MAX / 2;
+	CHECK(NULL == malloc_batch(NBATCH, sizes, failed));
+	CHECK(check_in_use() == before);
+	/* Each slab chunk went back: the same batch, less the big one, gets
+	 * them again, since a slab hands out its lowest free slot. */
+	sizes[NBATCH - 1] = 1;
+	CHECK(chunks == malloc_batch(NBATCH - 1, sizes, chunks));
+	for (int i = 0; i < NBATCH - 1; ++i)
+	{
+		if (sizes[i] <= 128) CHECK(chunks[i] == failed[i]);
+		CHECK(malloc_usable_size(chunks[i]) >= sizes[i]);
+	}
+	free_batch(chunks, NBATCH - 1);
+	CHECK(check_in_use() == before);
+
+	/* Small chunks are their class's size, and don't come from dlmalloc. */
+	void *small[128];
+	for (int i = 0; i < 128; ++i)
+	{
+		small[i] = malloc(i + 1);
+		CHECK(malloc_usable_size(small[i]) == (size_t) (i / 16 + 1) * 16);
+		CHECK((uintptr_t) small[i] % 16 == 0);
+	}
+	CHECK(check_in_use() == before);
+	for (int i = 0; i < 128; ++i) free(small[i]);
+	void *big = malloc(129);
+	CHECK(check_in_use() > before);
+	free(big);
+
+	/* realloc: to a bigger class, moving; within the slot, staying; down
+	 * to dlmalloc; and back, staying there. */
+	char *p = malloc(20);
+	strcpy(p, "nineteen characters");
+	char *q = realloc(p, 40);
+	CHECK(q != p && malloc_usable_size(q) == 48);
+	CHECK(0 == strcmp(q, "nineteen characters"));
+	CHECK(realloc(q, 10) == q);
+	char *r = realloc(q, 1000);
+	CHECK(r != q && malloc_usable_size(r) >= 1000 && check_in_use() > before);
+	CHECK(0 == strcmp(r, "nineteen characters"));
+	char *s = realloc(r, 30);
+	CHECK(malloc_usable_size(s) != 32); /* still dlmalloc's */
+	CHECK(0 == strcmp(s, "nineteen characters"));
+	free(s);
+	CHECK(check_in_use() == before);
+
+	printf("slab: ok\n");
+	return 0;
+}
@@ -0,0 +1,41 @@
+/* Check that tcache serves a freed chunk to the next malloc of its class,
+ * and that a thread's cached chunks go back to the allocator when the
+ * thread exits. */
+#include <pthread.h>
+#include "check.h"
+
+#define NCHUNKS 20
+
+static size_t in_use_while_cached;
+
+static void *churn(void *arg)
+{
+	void *chunks[NCHUNKS];
+	for (int i = 0; i < NCHUNKS; ++i) chunks[i] = malloc(100);
+	for (int i = 0; i < NCHUNKS; ++i) free(chunks[i]);
+	/* The last one freed is the first one reused. */
+	void *again = malloc(100);
+	CHECK(again == chunks[NCHUNKS - 1]);
+	free(again);
+	in_use_while_cached = check_in_use();
+	return NULL;
+}
+
+static size_t in_use_after_thread(void)
+{
+	pthread_t t;
+	CHECK(0 == pthread_create(&t, NULL, churn, NULL));
+	CHECK(0 == pthread_join(t, NULL));
+	return check_in_use();
+}
+
+int main(void)
+{
+	/* Once for whatever the first thread costs the C library. */
+	size_t before = in_use_after_thread();
+	size_t after = in_use_after_thread();
+	CHECK(in_use_while_cached >= before + NCHUNKS * 100);
+	CHECK(after == before);
+	printf("tcache: ok\n");
+	return 0;
+}
@@ -0,0 +1,35 @@
+/* What the check-*.c programs share: CHECK(cond) reports a failed
+ * condition and exits non-zero, and check_in_use() says how many bytes
+ * the underlying dlmalloc has allocated. */
+#ifndef CHECK_H_
+#define CHECK_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(cond) ((cond) ? (void) 0 : check_failed(#cond, __FILE__, __LINE__))
+static inline void check_failed(const char *cond, const char *file, int line)
+{
+	fprintf(stderr, "%s:%d: check failed: %s\n", file, line, cond);
+	exit(1);
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* dlmalloc's own, which is not glibc's (so don't include malloc.h). */
+struct dlmalloc_mallinfo
+{
+	size_t arena, ordblks, smblks, hblks, hblkhd, usmblks, fsmblks, uordblks, fordblks, keepcost;
+};
+struct dlmalloc_mallinfo mallinfo(void);
+size_t malloc_usable_size(void *ptr);
+#ifdef __cplusplus
+}
+#endif
+static inline size_t check_in_use(void)
+{
+	return mallinfo().uordblks;
+}
+
+#endif
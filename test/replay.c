@@ -0,0 +1,439 @@
+/* Replay a trace recorded by the trace hook (src/trace.c) against whatever
+ * malloc we are linked with, for comparing builds on real workloads.
+ *
+ * usage: replay <config> <build> <trace> [serial|threaded]
+ *
+ * We first decode the whole trace and merge its threads' records by time.
+ * Then, in that order, we resolve each record's trace addresses to chunk
+ * numbers, using an open-addressing table keyed by trace address; that
+ * way, replaying a record is just its malloc call and an array access.
+ * Records we can't make sense of (frees of chunks allocated before the
+ * trace started, failed allocations) are skipped.
+ *
+ * In serial mode (the default) one thread replays all records in the merged
+ * order, so every run does exactly the same calls. In threaded mode each
+ * traced thread is replayed by its own thread, in its own order; a thread
+ * that frees (or reallocs) a chunk allocated by another waits until that
+ * allocation has been replayed. Each new chunk is touched once per page,
+ * so that the RSS figures mean something.
+ *
+ * None of our own memory comes from malloc, so the heap holds only what
+ * the trace puts there. One CSV line goes to stdout:
+ *
+ *   config,build,trace,mode,threads,ops,ns_per_op,peak_live_kb,peak_rss_kb,fragmentation
+ *
+ * peak_rss_kb is the growth of the peak RSS over the replay, and
+ * fragmentation is that divided by the peak of bytes requested but not
+ * freed, so 1.0 means no overhead at all. (The two peaks need not coincide,
+ * so this is only an estimate.) They are NA if we can't reset the peak RSS.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mallochooks/trace.h"
+
+#define MAX_THREADS 4096
+#define PAGE_SIZE 4096
+
+enum replay_op { R_SKIP, R_MALLOC, R_CALLOC, R_MEMALIGN, R_FREE, R_REALLOC };
+
+struct event
+{
+	uint64_t ticks;
+	uintptr_t addr, new_addr;
+	size_t size, alignment;
+	uint32_t thread;
+	uint32_t chunk;     /* the chunk allocated (or freed, for R_FREE) */
+	uint32_t old_chunk; /* the chunk realloc'd */
+	unsigned char op;   /* a trace_op, then a replay_op */
+};
+
+static struct event *events;
+static size_t nevents;
+static uint32_t nthreads;
+static uint32_t tids[MAX_THREADS];
+static uint32_t nchunks;
+static void **chunks; /* by chunk number, once allocated */
+static size_t peak_live;
+
+static void die(const char *msg)
+{
+	fprintf(stderr, "replay: %s\n", msg);
+	exit(1);
+}
+
+/* Our own memory, which must not come from the malloc under test. */
+static void *get_memory(size_t size)
+{
+	void *ret = mmap(NULL, size ? size : 1, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (ret == MAP_FAILED) die("out of memory");
+	return ret;
+}
+static void put_memory(void *ptr, size_t size)
+{
+	munmap(ptr, size ? size : 1);
+}
+
+static uint32_t thread_number(uint32_t tid)
+{
+	for (uint32_t i = 0; i < nthreads; ++i) if (tids[i] == tid) return i;
+	if (nthreads == MAX_THREADS) die("too many threads");
+	tids[nthreads] = tid;
+	return nthreads++;
+}
+
+/* Decode every record in the file, in block order. */
+static void load(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat s;
+	if (fd == -1 || fstat(fd, &s) == -1) die("can't open trace");
+	if ((size_t) s.st_size < TRACE_BLOCK_SIZE) die("trace too short");
+	const unsigned char *file = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (file == MAP_FAILED) die("can't map trace");
+	close(fd);
+	const struct trace_file_header *h = (const void *) file;
+	if (memcmp(h->magic, TRACE_MAGIC, sizeof h->magic) != 0 || h->block_size != TRACE_BLOCK_SIZE)
+	{
+		die("not a trace, or the wrong version");
+	}
+	size_t nblocks = s.st_size / TRACE_BLOCK_SIZE - 1;
+	if (h->nblocks < nblocks) nblocks = h->nblocks;
+	for (unsigned pass = 0; pass < 2; ++pass)
+	{
+		nevents = 0;
+		for (size_t b = 0; b < nblocks; ++b)
+		{
+			const struct trace_block_header *block = (const void *) (file + (b + 1) * TRACE_BLOCK_SIZE);
+			if (block->used > TRACE_BLOCK_SIZE - sizeof *block) die("corrupt block");
+			if (!block->used) continue; /* maybe claimed just before a crash */
+			const unsigned char *pos = (const unsigned char *) (block + 1);
+			const unsigned char *end = pos + block->used;
+			uint32_t thread = thread_number(block->tid);
+			struct trace_cursor c;
+			struct trace_record r;
+			trace_cursor_init(&c, block);
+			while (pos < end)
+			{
+				pos = trace_decode(pos, &c, &r);
+				if (pass == 1) events[nevents] = (struct event) {
+					.ticks = r.ticks, .addr = r.addr, .new_addr = r.new_addr,
+					.size = r.size, .alignment = r.alignment, .thread = thread, .op = r.op
+				};
+				++nevents;
+			}
+		}
+		if (pass == 0) events = get_memory(nevents * sizeof *events);
+	}
+	munmap((void *) file, s.st_size);
+}
+
+/* A stable merge sort by time; each block is already sorted, so this is
+ * mostly merging. */
+static void sort_events(void)
+{
+	struct event *from = events;
+	struct event *to = get_memory(nevents * sizeof *events);
+	for (size_t width = 1; width < nevents; width *= 2)
+	{
+		for (size_t lo = 0; lo < nevents; lo += 2 * width)
+		{
+			size_t mid = lo + width < nevents ? lo + width : nevents;
+			size_t hi = lo + 2 * width < nevents ? lo + 2 * width : nevents;
+			size_t i = lo, j = mid, k = lo;
+			while (i < mid && j < hi) to[k++] = from[j].ticks < from[i].ticks ? from[j++] : from[i++];
+			while (i < mid) to[k++] = from[i++];
+			while (j < hi) to[k++] = from[j++];
+		}
+		struct event *tmp = from; from = to; to = tmp;
+	}
+	if (from != events) memcpy(events, from, nevents * sizeof *events);
+	put_memory(from == events ? to : from, nevents * sizeof *events);
+}
+
+/* The address table: trace address to chunk number, with linear probing
+ * and backward-shift deletion (so no tombstones). Zero is never a key. */
+struct slot { uintptr_t addr; uint32_t chunk; };
+static struct slot *table;
+static size_t table_mask;
+
+static inline size_t table_hash(uintptr_t addr)
+{
+	return (size_t) ((addr >> 4) * 0x9e3779b97f4a7c15ull) & table_mask;
+}
+static struct slot *table_find(uintptr_t addr)
+{
+	for (size_t i = table_hash(addr); ; i = (i + 1) & table_mask)
+	{
+		if (table[i].addr == addr) return &table[i];
+		if (!table[i].addr) return NULL;
+	}
+}
+/* Returns the chunk that was already there (its free was lost), or -1. */
+static uint32_t table_insert(uintptr_t addr, uint32_t chunk)
+{
+	size_t i = table_hash(addr);
+	while (table[i].addr && table[i].addr != addr) i = (i + 1) & table_mask;
+	uint32_t old = table[i].addr ? table[i].chunk : (uint32_t) -1;
+	table[i] = (struct slot) { addr, chunk };
+	return old;
+}
+static void table_remove(struct slot *s)
+{
+	size_t hole = s - table;
+	for (size_t i = (hole + 1) & table_mask; table[i].addr; i = (i + 1) & table_mask)
+	{
+		/* Move back any entry whose probe sequence passes through the hole. */
+		size_t home = table_hash(table[i].addr);
+		if (((i - home) & table_mask) >= ((i - hole) & table_mask))
+		{
+			table[hole] = table[i];
+			hole = i;
+		}
+	}
+	table[hole].addr = 0;
+}
+
+/* Turn each event into a replay op on chunk numbers. */
+static void resolve(void)
+{
+	size_t capacity = 16;
+	while (capacity < 2 * nevents) capacity *= 2;
+	table = get_memory(capacity * sizeof *table);
+	table_mask = capacity - 1;
+	size_t *sizes = get_memory(nevents * sizeof *sizes);
+	size_t live = 0;
+	for (size_t n = 0; n < nevents; ++n)
+	{
+		struct event *e = &events[n];
+		struct slot *s;
+		uintptr_t new_addr = e->addr;
+		unsigned char op = R_SKIP;
+		switch (e->op)
+		{
+			case TRACE_MALLOC: op = R_MALLOC; break;
+			case TRACE_CALLOC: op = R_CALLOC; break;
+			case TRACE_MEMALIGN: op = R_MEMALIGN; break;
+			case TRACE_FREE:
+			case TRACE_FREE_SIZED:
+				if ((s = table_find(e->addr)))
+				{
+					e->chunk = s->chunk;
+					live -= sizes[s->chunk];
+					table_remove(s);
+					op = R_FREE;
+				}
+				new_addr = 0;
+				break;
+			case TRACE_REALLOC:
+				new_addr = e->new_addr;
+				s = e->addr ? table_find(e->addr) : NULL;
+				if (!s) op = R_MALLOC; /* of a chunk we never saw */
+				else if (new_addr)
+				{
+					e->old_chunk = s->chunk;
+					live -= sizes[s->chunk];
+					table_remove(s);
+					op = R_REALLOC;
+				}
+				else if (e->size == 0)
+				{
+					e->chunk = s->chunk;
+					live -= sizes[s->chunk];
+					table_remove(s);
+					op = R_FREE;
+				}
+				/* else it failed, and the old chunk lives on */
+				break;
+			default: die("unknown op in trace");
+		}
+		if (op != R_FREE && op != R_SKIP)
+		{
+			if (!new_addr) op = R_SKIP; /* a failed allocation */
+			else
+			{
+				e->chunk = nchunks++;
+				sizes[e->chunk] = e->size;
+				uint32_t lost = table_insert(new_addr, e->chunk);
+				if (lost != (uint32_t) -1) live -= sizes[lost];
+				live += e->size;
+				if (live > peak_live) peak_live = live;
+			}
+		}
+		e->op = op;
+	}
+	put_memory(sizes, nevents * sizeof *sizes);
+	put_memory(table, capacity * sizeof *table);
+	chunks = get_memory(nchunks * sizeof *chunks);
+	memset(chunks, 0, nchunks * sizeof *chunks); /* so it is in the RSS already */
+}
+
+static void touch(void *ptr, size_t from, size_t to)
+{
+	for (size_t off = from; off < to; off += PAGE_SIZE) ((volatile char *) ptr)[off] = 1;
+}
+
+/* In threaded mode, a chunk may be allocated by another thread. */
+static void *wait_for(uint32_t chunk)
+{
+	void *ptr;
+	unsigned spins = 0;
+	while (!(ptr = __atomic_load_n(&chunks[chunk], __ATOMIC_ACQUIRE)))
+	{
+		if (++spins % 64 == 0) sched_yield();
+	}
+	return ptr;
+}
+
+static inline void replay_one(const struct event *e)
+{
+	void *ptr = NULL;
+	switch (e->op)
+	{
+		case R_MALLOC: ptr = malloc(e->size); break;
+		case R_CALLOC: ptr = calloc(1, e->size); break;
+		case R_MEMALIGN: ptr = memalign(e->alignment, e->size); break;
+		case R_FREE: free(wait_for(e->chunk)); return;
+		case R_REALLOC: ptr = realloc(wait_for(e->old_chunk), e->size); break;
+		default: return;
+	}
+	if (!ptr && e->size) die("allocation failed");
+	if (!ptr) ptr = malloc(1); /* so that the chunk is never null */
+	touch(ptr, e->op == R_REALLOC ? PAGE_SIZE : 0, e->size);
+	__atomic_store_n(&chunks[e->chunk], ptr, __ATOMIC_RELEASE);
+}
+
+struct thread_work
+{
+	uint32_t *events; /* indices, in order */
+	size_t n;
+	pthread_t thread;
+};
+static pthread_barrier_t barrier;
+
+static void *run_thread(void *arg)
+{
+	struct thread_work *w = arg;
+	pthread_barrier_wait(&barrier);
+	for (size_t i = 0; i < w->n; ++i) replay_one(&events[w->events[i]]);
+	pthread_barrier_wait(&barrier);
+	return NULL;
+}
+
+static double now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* In kB, from /proc/self/status, or 0 if we can't. */
+static long status_kb(const char *field)
+{
+	char buf[4096];
+	int fd = open("/proc/self/status", O_RDONLY);
+	if (fd == -1) return 0;
+	ssize_t len = read(fd, buf, sizeof buf - 1);
+	close(fd);
+	if (len <= 0) return 0;
+	buf[len] = '\0';
+	char *found = strstr(buf, field);
+	return found ? atol(found + strlen(field)) : 0;
+}
+/* Make the peak RSS the current RSS, or return 0 if we can't. */
+static int reset_peak_rss(void)
+{
+	int fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (fd == -1) return 0;
+	int ok = write(fd, "5", 1) == 1;
+	close(fd);
+	return ok;
+}
+
+static double replay_serial(void)
+{
+	double start = now_ns();
+	for (size_t n = 0; n < nevents; ++n) replay_one(&events[n]);
+	return now_ns() - start;
+}
+
+/* Done before the replay, like resolve(), to keep it out of the RSS figures. */
+static struct thread_work *work;
+static void prepare_threads(void)
+{
+	work = get_memory(nthreads * sizeof *work);
+	for (size_t n = 0; n < nevents; ++n) ++work[events[n].thread].n;
+	for (uint32_t t = 0; t < nthreads; ++t)
+	{
+		work[t].events = get_memory(work[t].n * sizeof *work[t].events);
+		work[t].n = 0;
+	}
+	for (size_t n = 0; n < nevents; ++n)
+	{
+		struct thread_work *w = &work[events[n].thread];
+		w->events[w->n++] = n;
+	}
+}
+
+static double replay_threaded(void)
+{
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (uint32_t t = 0; t < nthreads; ++t)
+	{
+		if (pthread_create(&work[t].thread, NULL, run_thread, &work[t]) != 0) die("can't create thread");
+	}
+	pthread_barrier_wait(&barrier);
+	double start = now_ns();
+	pthread_barrier_wait(&barrier);
+	double time = now_ns() - start;
+	for (uint32_t t = 0; t < nthreads; ++t) pthread_join(work[t].thread, NULL);
+	pthread_barrier_destroy(&barrier);
+	return time;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 4)
+	{
+		fprintf(stderr, "usage: %s <config> <build> <trace> [serial|threaded]\n", argv[0]);
+		return 1;
+	}
+	int threaded = argc > 4 && 0 == strcmp(argv[4], "threaded");
+	load(argv[3]);
+	sort_events();
+	resolve();
+	if (threaded) prepare_threads();
+
+	int have_rss = reset_peak_rss();
+	long base_rss = status_kb("VmRSS:");
+	double time = threaded ? replay_threaded() : replay_serial();
+	long peak_rss = status_kb("VmHWM:") - base_rss;
+
+	size_t ops = 0;
+	for (size_t n = 0; n < nevents; ++n) if (events[n].op != R_SKIP) ++ops;
+	printf("%s,%s,%s,%s,%u,%zu,%.2f,%zu,", argv[1], argv[2], argv[3],
+		threaded ? "threaded" : "serial", threaded ? nthreads : 1, ops,
+		ops ? time / ops : 0.0, peak_live / 1024);
+	if (have_rss && peak_rss >= 0) printf("%ld,%.3f\n", peak_rss,
+		peak_live ? peak_rss * 1024.0 / peak_live : 0.0);
+	else printf("NA,NA\n");
+
+	/* Free what the trace left live, so that leak checkers stay quiet. */
+	for (size_t n = 0; n < nevents; ++n)
+	{
+		if (events[n].op == R_FREE) chunks[events[n].chunk] = NULL;
+		if (events[n].op == R_REALLOC) chunks[events[n].old_chunk] = NULL;
+	}
+	for (uint32_t c = 0; c < nchunks; ++c) free(chunks[c]);
+	return 0;
+}